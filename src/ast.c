@@ -46,12 +46,14 @@ struct dict_entry {
 */
 struct dict_node {
     char *key;
+    uint32_t hash;            /* Of KEY, see dict_hash */
     struct dict_entry *entry; /* This will change as entries are looked up */
     struct dict_entry *mark;  /* Pointer to initial entry, will never change */
 };
 
-/* Nodes are kept sorted by their key, with NULL being smaller than any
-   string */
+/* Nodes are kept in a hash table with open addressing and linear probing.
+   SIZE is a power of two, unused slots are NULL, and no more than half of
+   the slots are ever used, so that probes stay short */
 struct dict {
     struct dict_node **nodes;
     uint32_t          size;
@@ -59,36 +61,88 @@ struct dict {
     bool              marked;
 };
 
-static const int dict_initial_size = 2;
-static const int dict_max_expansion = 128;
-static const uint32_t dict_max_size = (1<<24) - 1;
+static const uint32_t dict_initial_size = 2;
+static const uint32_t dict_max_size = 1U << 30;
+
+static uint32_t dict_hash(const char *key) {
+    uint32_t h = 2166136261U;
+
+    if (key == NULL)
+        return 0;
+    for (const char *s = key; *s != '\0'; s++) {
+        h ^= (unsigned char) *s;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Return the slot in DICT that holds KEY, or the empty slot where KEY
+   belongs if DICT does not contain it */
+static struct dict_node **dict_slot(struct dict *dict, const char *key,
+                                    uint32_t hash) {
+    uint32_t mask = dict->size - 1;
+
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        struct dict_node *node = dict->nodes[i];
+        if (node == NULL || (node->hash == hash && streqv(node->key, key)))
+            return dict->nodes + i;
+    }
+}
+
+/* Make room in DICT for N nodes altogether */
+static int dict_reserve(struct dict *dict, uint32_t n) {
+    struct dict_node **nodes = dict->nodes;
+    uint32_t size = dict->size;
+
+    if (n <= dict->size / 2)
+        return 0;
+    while (n > dict->size / 2) {
+        if (dict->size >= dict_max_size)
+            return -1;
+        dict->size *= 2;
+    }
+    if (ALLOC_N(dict->nodes, dict->size) < 0) {
+        dict->nodes = nodes;
+        dict->size = size;
+        return -1;
+    }
+    for (uint32_t i=0; i < size; i++) {
+        if (nodes[i] != NULL)
+            *dict_slot(dict, nodes[i]->key, nodes[i]->hash) = nodes[i];
+    }
+    free(nodes);
+    return 0;
+}
 
 struct dict *make_dict(char *key, struct skel *skel, struct dict *subdict) {
     struct dict *dict = NULL;
+    struct dict_node *node = NULL;
+
     if (ALLOC(dict) < 0)
         goto error;
     if (ALLOC_N(dict->nodes, dict_initial_size) < 0)
         goto error;
-    if (ALLOC(dict->nodes[0]) < 0)
+    if (ALLOC(node) < 0)
         goto error;
-    if (ALLOC(dict->nodes[0]->entry) < 0)
+    if (ALLOC(node->entry) < 0)
         goto error;
 
     dict->size = dict_initial_size;
     dict->used = 1;
-    dict->nodes[0]->key = key;
-    dict->nodes[0]->entry->skel = skel;
-    dict->nodes[0]->entry->dict = subdict;
-    dict->nodes[0]->mark = dict->nodes[0]->entry;
+    node->key = key;
+    node->hash = dict_hash(key);
+    node->entry->skel = skel;
+    node->entry->dict = subdict;
+    node->mark = node->entry;
+    *dict_slot(dict, key, node->hash) = node;
 
     return dict;
  error:
-    if (dict->nodes) {
-        if (dict->nodes[0])
-            FREE(dict->nodes[0]->entry);
-        FREE(dict->nodes[0]);
-    }
-    FREE(dict->nodes);
+    if (node != NULL)
+        FREE(node->entry);
+    FREE(node);
+    if (dict != NULL)
+        FREE(dict->nodes);
     FREE(dict);
     return NULL;
 }
@@ -97,8 +151,10 @@ void free_dict(struct dict *dict) {
     if (dict == NULL)
         return;
 
-    for (int i=0; i < dict->used; i++) {
+    for (uint32_t i=0; i < dict->size; i++) {
         struct dict_node *node = dict->nodes[i];
+        if (node == NULL)
+            continue;
         if (! dict->marked)
             node->mark = node->entry;
         while (node->mark != NULL) {
@@ -115,46 +171,9 @@ void free_dict(struct dict *dict) {
     FREE(dict);
 }
 
-/* Return the position of KEY in DICT as an integer between 0 and
-   DICT->USED.  If KEY is not in DICT, return a negative number P such that
-   -(P + 1) is the position at which KEY must be inserted to keep the keys
-   of the nodes in DICT sorted.
-*/
-static int dict_pos(struct dict *dict, const char *key) {
-    if (key == NULL) {
-        return (dict->nodes[0]->key == NULL) ? 0 : -1;
-    }
-
-    int l = dict->nodes[0]->key == NULL ? 1 : 0;
-    int h = dict->used;
-    while (l < h) {
-        int m = (l + h)/2;
-        int cmp = strcmp(dict->nodes[m]->key, key);
-        if (cmp > 0)
-            h = m;
-        else if (cmp < 0)
-            l = m + 1;
-        else
-            return m;
-    }
-    return -(l + 1);
-}
-
-static int dict_expand(struct dict *dict) {
-    uint32_t size = dict->size;
-
-    if (size == dict_max_size)
-        return -1;
-    if (size > dict_max_expansion)
-        size += dict_max_expansion;
-    else
-        size *= 2;
-    if (size > dict_max_size)
-        size = dict_max_size;
-    dict->size = size;
-    return REALLOC_N(dict->nodes, dict->size);
-}
-
+/* Add the entries of D2 after those of *DICT, and free D2. The nodes of
+   the smaller of the two dicts are moved into the bigger one, so that
+   building a dict one key at a time stays linear */
 int dict_append(struct dict **dict, struct dict *d2) {
     if (d2 == NULL)
         return 0;
@@ -165,28 +184,37 @@ int dict_append(struct dict **dict, struct dict *d2) {
     }
 
     struct dict *d1 = *dict;
-    for (int i2 = 0; i2 < d2->used; i2++) {
-        struct dict_node *n2 = d2->nodes[i2];
-        int i1 = dict_pos(d1, n2->key);
-        if (i1 < 0) {
-            i1 = - i1 - 1;
-            if (d1->size == d1->used) {
-                if (dict_expand(d1) < 0)
-                    return -1;
-            }
-            memmove(d1->nodes + i1 + 1, d1->nodes + i1,
-                    sizeof(*d1->nodes) * (d1->used - i1));
-            d1->nodes[i1] = n2;
-            d1->used += 1;
+    bool prepend = d2->used > d1->used;
+    struct dict *into = prepend ? d2 : d1;
+    struct dict *from = prepend ? d1 : d2;
+
+    if (dict_reserve(into, into->used + from->used) < 0)
+        return -1;
+
+    for (uint32_t i = 0; i < from->size; i++) {
+        struct dict_node *n2 = from->nodes[i];
+        if (n2 == NULL)
+            continue;
+        struct dict_node **slot = dict_slot(into, n2->key, n2->hash);
+        if (*slot == NULL) {
+            *slot = n2;
+            into->used += 1;
+            continue;
+        }
+        struct dict_node *n1 = *slot;
+        if (prepend) {
+            /* The entries from *DICT come first */
+            n2->mark->next = n1->entry;
+            n1->entry = n2->entry;
         } else {
-            struct dict_node *n1 = d1->nodes[i1];
             list_tail_cons(n1->entry, n1->mark, n2->entry);
-            FREE(n2->key);
-            FREE(n2);
         }
+        FREE(n2->key);
+        FREE(n2);
     }
-    FREE(d2->nodes);
-    FREE(d2);
+    FREE(from->nodes);
+    FREE(from);
+    *dict = into;
     return 0;
 }
 
@@ -196,19 +224,17 @@ void dict_lookup(const char *key, struct dict *dict,
     *subdict = NULL;
     if (dict != NULL) {
         if (! dict->marked) {
-            for (int i=0; i < dict->used; i++) {
-                dict->nodes[i]->mark = dict->nodes[i]->entry;
+            for (uint32_t i=0; i < dict->size; i++) {
+                if (dict->nodes[i] != NULL)
+                    dict->nodes[i]->mark = dict->nodes[i]->entry;
             }
             dict->marked = 1;
         }
-        int p = dict_pos(dict, key);
-        if (p >= 0) {
-            struct dict_node *node = dict->nodes[p];
-            if (node->entry != NULL) {
-                *skel = node->entry->skel;
-                *subdict = node->entry->dict;
-                node->entry = node->entry->next;
-            }
+        struct dict_node *node = *dict_slot(dict, key, dict_hash(key));
+        if (node != NULL && node->entry != NULL) {
+            *skel = node->entry->skel;
+            *subdict = node->entry->dict;
+            node->entry = node->entry->next;
         }
     }
 }
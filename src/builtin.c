@@ -106,7 +106,7 @@ static struct value *make_exn_lns_error(struct info *info,
     if (HAS_ERR(info))
         return info->error->exn;
 
-    v = make_exn_value(ref(info), "%s", err->message);
+    v = make_exn_value(ref(info), "%s", lns_error_message(err));
     if (err->lens != NULL) {
         char *s = format_info(err->lens->info);
         exn_printf_line(v, "Lens: %s", s);
@@ -0,0 +1,1333 @@
+/*
+ * cache.c: on-disk cache of compiled modules
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <argz.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "syntax.h"
+#include "transform.h"
+#include "memory.h"
+#include "errcode.h"
+#include "hash.h"
+
+/* A cache file consists of
+ *
+ *   header  CACHE_MAGIC, CACHE_FORMAT, PACKAGE_VERSION, flags,
+ *           module name, digest of the module's source, and the name
+ *           and source digest of every module it depends on
+ *   body    the module's bindings and autoload transform
+ *   trailer digest of everything before it
+ *
+ * Integers are stored little-endian with fixed width; strings as their
+ * length followed by their bytes. In the body, every pointer is written
+ * as one of the P_* markers: the first time we encounter an object, it
+ * gets the next id and its contents follow inline, later encounters only
+ * write the id. That preserves sharing and the cycles that recursive
+ * lenses create. The Builtin module is part of the library, and objects
+ * from it are written by name.
+ *
+ * CACHE_FORMAT must be bumped whenever the layout of any of the written
+ * structures changes.
+ */
+#define CACHE_MAGIC     "HERACACH"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_FORMAT    1
+
+/* The cache file for hosts.aug is hosts.augc */
+#define CACHE_EXT       "c"
+
+/* Limit how deeply we recurse while reading so that a file we do not
+ * understand can not exhaust the stack */
+#define CACHE_MAX_DEPTH 4096
+
+/* Flags that affect what COMPILE produces */
+#define CACHE_FLAGS     HERA_TYPE_CHECK
+
+#define NO_STRING       UINT32_MAX
+
+#define FNV_OFFSET      0xcbf29ce484222325ULL
+#define FNV_PRIME       0x100000001b3ULL
+
+enum cache_ptr {
+    P_NULL,
+    P_BACKREF,                  /* followed by the object id */
+    P_NEW,                      /* followed by kind and contents */
+    P_BUILTIN,                  /* followed by kind and name */
+    P_BASETYPE                  /* followed by the type tag */
+};
+
+enum cache_kind {
+    K_STRING = 1,
+    K_INFO,
+    K_REGEXP,
+    K_LENS,
+    K_TYPE,
+    K_TERM,
+    K_PARAM,
+    K_BINDING,
+    K_VALUE,
+    K_FILTER,
+    K_TRANSFORM
+};
+
+struct module_cache {
+    char   *dir;
+    hash_t *digests;            /* source file name -> uint64_t digest */
+};
+
+static uint64_t digest(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static void digest_node_free(hnode_t *node, ATTRIBUTE_UNUSED void *ctx) {
+    free((void *) hnode_getkey(node));
+    free(hnode_get(node));
+    free(node);
+}
+
+/* Digest of the contents of FILENAME. Source files are only read once
+ * per instance */
+static int source_digest(struct module_cache *cache, const char *filename,
+                         uint64_t *d) {
+    hnode_t *node = hash_lookup(cache->digests, filename);
+    struct file_map fm;
+    char *key = NULL;
+    uint64_t *val = NULL;
+
+    if (node != NULL) {
+        *d = *(uint64_t *) hnode_get(node);
+        return 0;
+    }
+
+    if (map_file(filename, &fm) < 0)
+        return -1;
+    *d = digest(FNV_OFFSET, fm.text, fm.len);
+    unmap_file(&fm);
+
+    key = strdup(filename);
+    if (key == NULL || ALLOC(val) < 0)
+        goto error;
+    *val = *d;
+    if (hash_alloc_insert(cache->digests, key, val) < 0)
+        goto error;
+    return 0;
+ error:
+    free(key);
+    free(val);
+    return -1;
+}
+
+/* Digest of the source of module MODNAME as currently found on the load
+ * path */
+static int module_digest(struct heracles *hera, const char *modname,
+                         uint64_t *d) {
+    char *filename = module_filename(hera, modname);
+    int r;
+
+    if (filename == NULL)
+        return -1;
+    r = source_digest(hera->cache, filename, d);
+    free(filename);
+    return r;
+}
+
+static char *cache_filename(struct module_cache *cache,
+                            const char *filename) {
+    const char *base = strrchr(filename, SEP);
+    char *result = NULL;
+
+    base = (base == NULL) ? filename : base + 1;
+    if (xasprintf(&result, "%s/%s" CACHE_EXT, cache->dir, base) < 0)
+        return NULL;
+    return result;
+}
+
+static hash_val_t ptr_hash(const void *p) {
+    uintptr_t v = (uintptr_t) p;
+    return (hash_val_t) ((v >> 4) ^ (v >> 16));
+}
+
+static int ptr_cmp(const void *p1, const void *p2) {
+    return p1 != p2;
+}
+
+/* The native value inside the closure that the Builtin module binds for
+ * a native function */
+static struct value *native_of(struct value *v) {
+    struct term *t;
+
+    if (v == NULL || v->tag != V_CLOS)
+        return NULL;
+    for (t = v->func; t != NULL && t->tag == A_FUNC; t = t->body);
+    if (t == NULL || t->tag != A_VALUE || t->value->tag != V_NATIVE)
+        return NULL;
+    return t->value;
+}
+
+/*
+ * Writing
+ */
+struct writer {
+    FILE         *out;
+    hash_t       *ids;          /* object -> id */
+    hash_t       *builtins;     /* Builtin binding or value -> name */
+    unsigned int  next_id;
+    int           failed;
+};
+
+static void put_u8(struct writer *w, unsigned int v) {
+    if (putc(v & 0xff, w->out) == EOF)
+        w->failed = 1;
+}
+
+static void put_u32(struct writer *w, uint32_t v) {
+    for (int i=0; i < 4; i++)
+        put_u8(w, v >> (8*i));
+}
+
+static void put_u64(struct writer *w, uint64_t v) {
+    for (int i=0; i < 8; i++)
+        put_u8(w, v >> (8*i));
+}
+
+static void put_str(struct writer *w, const char *s) {
+    if (s == NULL) {
+        put_u32(w, NO_STRING);
+        return;
+    }
+    size_t len = strlen(s);
+    if (len >= NO_STRING) {
+        w->failed = 1;
+        return;
+    }
+    put_u32(w, len);
+    if (fwrite(s, 1, len, w->out) != len)
+        w->failed = 1;
+}
+
+/* Write the marker for pointer P. Return 1 if P needs to be written
+ * in full by the caller, 0 otherwise */
+static int put_ref(struct writer *w, const void *p, enum cache_kind kind) {
+    hnode_t *node;
+
+    if (w->failed)
+        return 0;
+    if (p == NULL) {
+        put_u8(w, P_NULL);
+        return 0;
+    }
+    if (w->builtins != NULL) {
+        node = hash_lookup(w->builtins, p);
+        if (node != NULL) {
+            put_u8(w, P_BUILTIN);
+            put_u8(w, kind);
+            put_str(w, hnode_get(node));
+            if (kind == K_VALUE)
+                put_u8(w, ((struct value *) p)->tag == V_NATIVE);
+            return 0;
+        }
+    }
+    node = hash_lookup(w->ids, p);
+    if (node != NULL) {
+        put_u8(w, P_BACKREF);
+        put_u32(w, (uintptr_t) hnode_get(node));
+        return 0;
+    }
+    if (hash_alloc_insert(w->ids, p, (void *) (uintptr_t) w->next_id) < 0) {
+        w->failed = 1;
+        return 0;
+    }
+    w->next_id += 1;
+    put_u8(w, P_NEW);
+    put_u8(w, kind);
+    return 1;
+}
+
+static void put_string(struct writer *w, struct string *s) {
+    if (put_ref(w, s, K_STRING))
+        put_str(w, s->str);
+}
+
+static void put_info(struct writer *w, struct info *info) {
+    if (!put_ref(w, info, K_INFO))
+        return;
+    put_string(w, info->filename);
+    put_u32(w, info->first_line);
+    put_u32(w, info->first_column);
+    put_u32(w, info->last_line);
+    put_u32(w, info->last_column);
+    put_u32(w, info->flags);
+}
+
+static void put_regexp(struct writer *w, struct regexp *re) {
+    if (!put_ref(w, re, K_REGEXP))
+        return;
+    put_info(w, re->info);
+    put_string(w, re->pattern);
+    put_u8(w, re->nocase);
+}
+
+static void put_lens(struct writer *w, struct lens *l) {
+    if (!put_ref(w, l, K_LENS))
+        return;
+    put_u32(w, l->tag);
+    put_u8(w, l->value | l->key << 1 | l->recursive << 2
+           | l->consumes_value << 3 | l->rec_internal << 4
+           | l->ctype_nullable << 5);
+    put_info(w, l->info);
+    put_regexp(w, l->ctype);
+    put_regexp(w, l->atype);
+    put_regexp(w, l->ktype);
+    put_regexp(w, l->vtype);
+    switch (l->tag) {
+    case L_DEL:
+        put_regexp(w, l->regexp);
+        put_string(w, l->string);
+        break;
+    case L_STORE:
+    case L_KEY:
+        put_regexp(w, l->regexp);
+        break;
+    case L_LABEL:
+    case L_SEQ:
+    case L_COUNTER:
+    case L_VALUE:
+        put_string(w, l->string);
+        break;
+    case L_SUBTREE:
+    case L_STAR:
+    case L_MAYBE:
+    case L_SQUARE:
+        put_lens(w, l->child);
+        break;
+    case L_CONCAT:
+    case L_UNION:
+        put_u32(w, l->nchildren);
+        for (int i=0; i < l->nchildren; i++)
+            put_lens(w, l->children[i]);
+        break;
+    case L_REC:
+        put_lens(w, l->body);
+        put_lens(w, l->alias);
+        break;
+    default:
+        w->failed = 1;
+        break;
+    }
+}
+
+static void put_type(struct writer *w, struct type *t) {
+    if (t != NULL && t->tag != T_ARROW) {
+        put_u8(w, P_BASETYPE);
+        put_u8(w, t->tag);
+        return;
+    }
+    if (!put_ref(w, t, K_TYPE))
+        return;
+    put_type(w, t->dom);
+    put_type(w, t->img);
+}
+
+static void put_value(struct writer *w, struct value *v);
+
+static void put_param(struct writer *w, struct param *param) {
+    if (!put_ref(w, param, K_PARAM))
+        return;
+    put_info(w, param->info);
+    put_string(w, param->name);
+    put_type(w, param->type);
+}
+
+static void put_term(struct writer *w, struct term *term) {
+    if (!put_ref(w, term, K_TERM))
+        return;
+    put_u32(w, term->tag);
+    put_info(w, term->info);
+    put_type(w, term->type);
+    put_term(w, term->next);
+    switch (term->tag) {
+    case A_MODULE:
+        put_str(w, term->mname);
+        put_str(w, term->autoload);
+        put_term(w, term->decls);
+        break;
+    case A_BIND:
+        put_str(w, term->bname);
+        put_term(w, term->exp);
+        break;
+    case A_COMPOSE:
+    case A_UNION:
+    case A_MINUS:
+    case A_CONCAT:
+    case A_APP:
+    case A_LET:
+        put_term(w, term->left);
+        put_term(w, term->right);
+        break;
+    case A_VALUE:
+        put_value(w, term->value);
+        break;
+    case A_IDENT:
+        put_string(w, term->ident);
+        break;
+    case A_BRACKET:
+        put_term(w, term->brexp);
+        break;
+    case A_FUNC:
+        put_param(w, term->param);
+        put_term(w, term->body);
+        break;
+    case A_REP:
+        put_u32(w, term->quant);
+        put_term(w, term->rexp);
+        break;
+    case A_TEST:
+        put_u32(w, term->tr_tag);
+        put_term(w, term->test);
+        put_term(w, term->result);
+        break;
+    default:
+        w->failed = 1;
+        break;
+    }
+}
+
+static void put_filter(struct writer *w, struct filter *f) {
+    if (!put_ref(w, f, K_FILTER))
+        return;
+    put_filter(w, f->next);
+    put_string(w, f->glob);
+    put_u8(w, f->include);
+}
+
+static void put_transform(struct writer *w, struct transform *xform) {
+    if (!put_ref(w, xform, K_TRANSFORM))
+        return;
+    put_lens(w, xform->lens);
+    put_filter(w, xform->filter);
+}
+
+static void put_binding(struct writer *w, struct binding *b) {
+    if (!put_ref(w, b, K_BINDING))
+        return;
+    put_binding(w, b->next);
+    put_string(w, b->ident);
+    put_type(w, b->type);
+    put_value(w, b->value);
+}
+
+static void put_value(struct writer *w, struct value *v) {
+    if (!put_ref(w, v, K_VALUE))
+        return;
+    put_u32(w, v->tag);
+    put_info(w, v->info);
+    switch (v->tag) {
+    case V_STRING:
+        put_string(w, v->string);
+        break;
+    case V_REGEXP:
+        put_regexp(w, v->regexp);
+        break;
+    case V_LENS:
+        put_lens(w, v->lens);
+        break;
+    case V_FILTER:
+        put_filter(w, v->filter);
+        break;
+    case V_TRANSFORM:
+        put_transform(w, v->transform);
+        break;
+    case V_CLOS:
+        put_term(w, v->func);
+        put_binding(w, v->bindings);
+        break;
+    case V_UNIT:
+        break;
+    default:
+        /* Trees, exceptions and natives outside of Builtin never make it
+         * into a module in practice; we just don't cache such modules */
+        w->failed = 1;
+        break;
+    }
+}
+
+static int add_builtin(hash_t *builtins, const void *p, const char *name) {
+    if (p == NULL || hash_lookup(builtins, p) != NULL)
+        return 0;
+    return hash_alloc_insert(builtins, p, (void *) name);
+}
+
+static hash_t *make_builtins(struct heracles *hera) {
+    struct module *builtin = module_lookup(hera, builtin_module);
+    hash_t *builtins = hash_create(HASHCOUNT_T_MAX, ptr_cmp, ptr_hash);
+
+    if (builtins == NULL || builtin == NULL)
+        goto error;
+
+    list_for_each(b, builtin->bindings) {
+        const char *name = b->ident->str;
+        if (add_builtin(builtins, b, name) < 0
+            || add_builtin(builtins, b->value, name) < 0
+            || add_builtin(builtins, native_of(b->value), name) < 0)
+            goto error;
+    }
+    return builtins;
+ error:
+    if (builtins != NULL) {
+        hash_free_nodes(builtins);
+        hash_destroy(builtins);
+    }
+    return NULL;
+}
+
+static int write_file(const char *path, const char *buf, size_t len) {
+    char *tmp = NULL;
+    FILE *fp = NULL;
+    int fd = -1;
+
+    if (xasprintf(&tmp, "%s.XXXXXX", path) < 0)
+        return -1;
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        goto error;
+    fp = fdopen(fd, "w");
+    if (fp == NULL)
+        goto error;
+    fd = -1;
+    if (fwrite(buf, 1, len, fp) != len)
+        goto error;
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto error;
+    }
+    fp = NULL;
+    /* Readers either see the old file or the complete new one */
+    if (rename(tmp, path) < 0)
+        goto error;
+    free(tmp);
+    return 0;
+ error:
+    if (fp != NULL)
+        fclose(fp);
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+}
+
+void cache_store(struct heracles *hera, const char *filename,
+                 struct module *module) {
+    struct writer w;
+    struct memstream ms;
+    char *path = NULL;
+    const char *dep = NULL;
+    uint64_t d;
+    int r;
+
+    if (hera->cache == NULL)
+        return;
+
+    MEMZERO(&w, 1);
+    MEMZERO(&ms, 1);
+    r = init_memstream(&ms);
+    if (r < 0)
+        return;
+    w.out = ms.stream;
+    w.ids = hash_create(HASHCOUNT_T_MAX, ptr_cmp, ptr_hash);
+    w.builtins = make_builtins(hera);
+    if (w.ids == NULL || w.builtins == NULL)
+        w.failed = 1;
+
+    if (fwrite(CACHE_MAGIC, 1, CACHE_MAGIC_LEN, w.out) != CACHE_MAGIC_LEN)
+        w.failed = 1;
+    put_u32(&w, CACHE_FORMAT);
+    put_str(&w, PACKAGE_VERSION);
+    put_u32(&w, hera->flags & CACHE_FLAGS);
+    put_str(&w, module->name);
+    if (source_digest(hera->cache, filename, &d) < 0)
+        w.failed = 1;
+    put_u64(&w, d);
+    /* Modules without a source file, like Sys, make MODULE depend on the
+     * environment; we can't compute a digest for them and therefore never
+     * cache such a module */
+    put_u32(&w, argz_count(module->depz, module->ndepz));
+    while ((dep = argz_next(module->depz, module->ndepz, dep)) != NULL) {
+        if (module_digest(hera, dep, &d) < 0)
+            w.failed = 1;
+        put_str(&w, dep);
+        put_u64(&w, d);
+    }
+
+    put_binding(&w, module->bindings);
+    put_transform(&w, module->autoload);
+
+    r = close_memstream(&ms);
+    if (r < 0 || w.failed)
+        goto done;
+
+    d = digest(FNV_OFFSET, ms.buf, ms.size);
+    if (REALLOC_N(ms.buf, ms.size + sizeof(d)) < 0)
+        goto done;
+    for (int i=0; i < sizeof(d); i++)
+        ms.buf[ms.size++] = d >> (8*i);
+
+    path = cache_filename(hera->cache, filename);
+    if (path != NULL)
+        write_file(path, ms.buf, ms.size);
+
+ done:
+    free(path);
+    free(ms.buf);
+    if (w.ids != NULL) {
+        hash_free_nodes(w.ids);
+        hash_destroy(w.ids);
+    }
+    if (w.builtins != NULL) {
+        hash_free_nodes(w.builtins);
+        hash_destroy(w.builtins);
+    }
+}
+
+/*
+ * Reading
+ */
+struct reader {
+    const char        *buf;
+    size_t             len;
+    size_t             pos;
+    struct heracles   *hera;
+    struct module     *builtin;
+    /* Every object we create, indexed by id. The reader holds one
+     * reference to each of them until it is done */
+    void             **objs;
+    unsigned char     *kinds;
+    size_t             nobjs;
+    size_t             size;
+    unsigned int       depth;
+    int                failed;
+};
+
+static unsigned int get_u8(struct reader *r) {
+    if (r->pos + 1 > r->len) {
+        r->failed = 1;
+        return 0;
+    }
+    return (unsigned char) r->buf[r->pos++];
+}
+
+static uint32_t get_u32(struct reader *r) {
+    uint32_t v = 0;
+    for (int i=0; i < 4; i++)
+        v |= (uint32_t) get_u8(r) << (8*i);
+    return v;
+}
+
+static uint64_t get_u64(struct reader *r) {
+    uint64_t v = 0;
+    for (int i=0; i < 8; i++)
+        v |= (uint64_t) get_u8(r) << (8*i);
+    return v;
+}
+
+/* Read a string into newly allocated memory. Return NULL for a NULL
+ * string and on failure */
+static char *get_str(struct reader *r) {
+    uint32_t len = get_u32(r);
+    char *s;
+
+    if (r->failed || len == NO_STRING)
+        return NULL;
+    if (len > r->len - r->pos) {
+        r->failed = 1;
+        return NULL;
+    }
+    s = strndup(r->buf + r->pos, len);
+    if (s == NULL)
+        r->failed = 1;
+    r->pos += len;
+    return s;
+}
+
+static int add_obj(struct reader *r, void *obj, enum cache_kind kind) {
+    if (r->nobjs == r->size) {
+        size_t size = (r->size == 0) ? 64 : 2 * r->size;
+        if (REALLOC_N(r->objs, size) < 0
+            || REALLOC_N(r->kinds, size) < 0) {
+            r->failed = 1;
+            return -1;
+        }
+        r->size = size;
+    }
+    r->objs[r->nobjs] = obj;
+    r->kinds[r->nobjs] = kind;
+    r->nobjs += 1;
+    return 0;
+}
+
+/* Allocate a new object of KIND, register it, and hand back a pointer
+ * to it in *OBJ. The object starts out with the reader's reference */
+#define new_obj(r, obj, kind)                                          \
+    ((ALLOC(obj) < 0 || add_obj(r, obj, kind) < 0)                     \
+     ? (free(obj), (obj) = NULL, (r)->failed = 1, -1)                  \
+     : ((obj)->ref = 1, 0))
+
+static struct binding *builtin_binding(struct reader *r, const char *name) {
+    list_for_each(b, r->builtin->bindings) {
+        if (STREQ(b->ident->str, name))
+            return b;
+    }
+    return NULL;
+}
+
+/* Read a pointer marker. Return 1 if the caller needs to create a new
+ * object of KIND and read its contents. Otherwise, return 0 and set *OBJ
+ * to the object that was referenced, which might be NULL */
+static int get_ref(struct reader *r, enum cache_kind kind, void **obj) {
+    unsigned int p = get_u8(r);
+    uint32_t id;
+
+    *obj = NULL;
+    if (r->failed)
+        return 0;
+
+    switch (p) {
+    case P_NULL:
+        return 0;
+    case P_BACKREF:
+        id = get_u32(r);
+        if (id >= r->nobjs || r->kinds[id] != kind)
+            break;
+        *obj = r->objs[id];
+        return 0;
+    case P_NEW:
+        if (get_u8(r) != kind || r->depth >= CACHE_MAX_DEPTH)
+            break;
+        return 1;
+    case P_BUILTIN: {
+        char *name;
+        struct binding *b;
+
+        if (get_u8(r) != kind)
+            break;
+        name = get_str(r);
+        if (name == NULL)
+            break;
+        b = builtin_binding(r, name);
+        free(name);
+        if (b == NULL)
+            break;
+        if (kind == K_BINDING)
+            *obj = b;
+        else if (kind == K_VALUE)
+            *obj = get_u8(r) ? native_of(b->value) : b->value;
+        if (*obj == NULL)
+            break;
+        return 0;
+    }
+    default:
+        break;
+    }
+    r->failed = 1;
+    return 0;
+}
+
+/* The GET_* functions return a new reference to the object they read,
+ * or NULL. Errors are recorded in R->FAILED */
+static struct string *get_string(struct reader *r) {
+    struct string *s = NULL;
+
+    if (get_ref(r, K_STRING, (void **) &s) && new_obj(r, s, K_STRING) == 0) {
+        s->str = get_str(r);
+        if (s->str == NULL)
+            r->failed = 1;
+    }
+    return ref(s);
+}
+
+static struct info *get_info(struct reader *r) {
+    struct info *info = NULL;
+
+    if (get_ref(r, K_INFO, (void **) &info)
+        && new_obj(r, info, K_INFO) == 0) {
+        info->error = r->hera->error;
+        info->filename = get_string(r);
+        info->first_line = get_u32(r);
+        info->first_column = get_u32(r);
+        info->last_line = get_u32(r);
+        info->last_column = get_u32(r);
+        info->flags = get_u32(r);
+    }
+    return ref(info);
+}
+
+static struct regexp *get_regexp(struct reader *r) {
+    struct regexp *re = NULL;
+
+    if (get_ref(r, K_REGEXP, (void **) &re)
+        && new_obj(r, re, K_REGEXP) == 0) {
+        re->info = get_info(r);
+        re->pattern = get_string(r);
+        re->nocase = get_u8(r);
+        if (re->pattern == NULL)
+            r->failed = 1;
+    }
+    return ref(re);
+}
+
+static struct lens *get_lens(struct reader *r);
+
+/* For the links between the two instances of a recursive lens, which do
+ * not own a reference. The reader still holds one, so this can't drop
+ * the count to 0 */
+static struct lens *get_lens_weak(struct reader *r) {
+    struct lens *l = get_lens(r);
+    if (l != NULL)
+        l->ref -= 1;
+    return l;
+}
+
+static void get_lens_fields(struct reader *r, struct lens *l) {
+    unsigned int tag, flags;
+
+    tag = get_u32(r);
+    if (tag < L_DEL || tag > L_SQUARE) {
+        /* FREE_LENS needs a valid tag */
+        r->failed = 1;
+        return;
+    }
+    l->tag = tag;
+    flags = get_u8(r);
+    l->value = flags & 1;
+    l->key = (flags >> 1) & 1;
+    l->recursive = (flags >> 2) & 1;
+    l->consumes_value = (flags >> 3) & 1;
+    l->rec_internal = (flags >> 4) & 1;
+    l->ctype_nullable = (flags >> 5) & 1;
+    l->info = get_info(r);
+    l->ctype = get_regexp(r);
+    l->atype = get_regexp(r);
+    l->ktype = get_regexp(r);
+    l->vtype = get_regexp(r);
+    if (r->failed)
+        return;
+
+    switch (l->tag) {
+    case L_DEL:
+        l->regexp = get_regexp(r);
+        l->string = get_string(r);
+        break;
+    case L_STORE:
+    case L_KEY:
+        l->regexp = get_regexp(r);
+        break;
+    case L_LABEL:
+    case L_SEQ:
+    case L_COUNTER:
+    case L_VALUE:
+        l->string = get_string(r);
+        break;
+    case L_SUBTREE:
+    case L_STAR:
+    case L_MAYBE:
+    case L_SQUARE:
+        l->child = get_lens(r);
+        break;
+    case L_CONCAT:
+    case L_UNION: {
+        uint32_t n = get_u32(r);
+        if (r->failed || n == 0 || n > r->len - r->pos
+            || ALLOC_N(l->children, n) < 0) {
+            r->failed = 1;
+            break;
+        }
+        l->nchildren = n;
+        for (int i=0; i < n && !r->failed; i++)
+            l->children[i] = get_lens(r);
+        break;
+    }
+    case L_REC:
+        /* The internal instance does not own its body, see lens.h */
+        if (l->rec_internal)
+            l->body = get_lens_weak(r);
+        else
+            l->body = get_lens(r);
+        l->alias = get_lens_weak(r);
+        break;
+    default:
+        r->failed = 1;
+        break;
+    }
+}
+
+static struct lens *get_lens(struct reader *r) {
+    struct lens *l = NULL;
+
+    if (get_ref(r, K_LENS, (void **) &l) && new_obj(r, l, K_LENS) == 0) {
+        /* Until we know better, pretend to be a lens without children
+         * so that FREE_LENS can cope */
+        l->tag = L_DEL;
+        r->depth += 1;
+        get_lens_fields(r, l);
+        r->depth -= 1;
+    }
+    return ref(l);
+}
+
+static struct type *get_type(struct reader *r) {
+    struct type *t = NULL;
+
+    if (r->failed)
+        return NULL;
+    /* Base types are shared singletons that are never written in full */
+    if (r->pos < r->len && r->buf[r->pos] == P_BASETYPE) {
+        unsigned int tag;
+        r->pos += 1;
+        tag = get_u8(r);
+        if (r->failed || tag > T_UNIT || tag == T_ARROW) {
+            r->failed = 1;
+            return NULL;
+        }
+        return make_base_type(tag);
+    }
+
+    if (get_ref(r, K_TYPE, (void **) &t) && new_obj(r, t, K_TYPE) == 0) {
+        r->depth += 1;
+        t->tag = T_ARROW;
+        t->dom = get_type(r);
+        t->img = get_type(r);
+        if (t->dom == NULL || t->img == NULL)
+            r->failed = 1;
+        r->depth -= 1;
+    }
+    return ref(t);
+}
+
+static struct value *get_value(struct reader *r);
+static struct term *get_term(struct reader *r);
+
+static struct param *get_param(struct reader *r) {
+    struct param *param = NULL;
+
+    if (get_ref(r, K_PARAM, (void **) &param)
+        && new_obj(r, param, K_PARAM) == 0) {
+        param->info = get_info(r);
+        param->name = get_string(r);
+        param->type = get_type(r);
+    }
+    return ref(param);
+}
+
+static void get_term_fields(struct reader *r, struct term *term) {
+    unsigned int tag = get_u32(r);
+
+    if (tag > A_TEST) {
+        r->failed = 1;
+        return;
+    }
+    term->tag = tag;
+    term->info = get_info(r);
+    term->type = get_type(r);
+    term->next = get_term(r);
+
+    switch (term->tag) {
+    case A_MODULE:
+        term->mname = get_str(r);
+        term->autoload = get_str(r);
+        term->decls = get_term(r);
+        break;
+    case A_BIND:
+        term->bname = get_str(r);
+        term->exp = get_term(r);
+        break;
+    case A_COMPOSE:
+    case A_UNION:
+    case A_MINUS:
+    case A_CONCAT:
+    case A_APP:
+    case A_LET:
+        term->left = get_term(r);
+        term->right = get_term(r);
+        break;
+    case A_VALUE:
+        term->value = get_value(r);
+        break;
+    case A_IDENT:
+        term->ident = get_string(r);
+        break;
+    case A_BRACKET:
+        term->brexp = get_term(r);
+        break;
+    case A_FUNC:
+        term->param = get_param(r);
+        term->body = get_term(r);
+        break;
+    case A_REP:
+        term->quant = get_u32(r);
+        term->rexp = get_term(r);
+        break;
+    case A_TEST:
+        term->tr_tag = get_u32(r);
+        term->test = get_term(r);
+        term->result = get_term(r);
+        break;
+    default:
+        r->failed = 1;
+        break;
+    }
+}
+
+static struct term *get_term(struct reader *r) {
+    struct term *term = NULL;
+
+    if (get_ref(r, K_TERM, (void **) &term)
+        && new_obj(r, term, K_TERM) == 0) {
+        /* FREE_TERM needs a valid tag */
+        term->tag = A_IDENT;
+        r->depth += 1;
+        get_term_fields(r, term);
+        r->depth -= 1;
+    }
+    return ref(term);
+}
+
+static struct filter *get_filter(struct reader *r) {
+    struct filter *f = NULL;
+
+    if (get_ref(r, K_FILTER, (void **) &f) && new_obj(r, f, K_FILTER) == 0) {
+        r->depth += 1;
+        f->next = get_filter(r);
+        f->glob = get_string(r);
+        f->include = get_u8(r);
+        r->depth -= 1;
+    }
+    return ref(f);
+}
+
+static struct transform *get_transform(struct reader *r) {
+    struct transform *xform = NULL;
+
+    if (get_ref(r, K_TRANSFORM, (void **) &xform)
+        && new_obj(r, xform, K_TRANSFORM) == 0) {
+        xform->lens = get_lens(r);
+        xform->filter = get_filter(r);
+    }
+    return ref(xform);
+}
+
+static struct binding *get_binding(struct reader *r) {
+    struct binding *b = NULL;
+
+    if (get_ref(r, K_BINDING, (void **) &b)
+        && new_obj(r, b, K_BINDING) == 0) {
+        r->depth += 1;
+        b->next = get_binding(r);
+        b->ident = get_string(r);
+        b->type = get_type(r);
+        b->value = get_value(r);
+        if (b->ident == NULL || b->type == NULL)
+            r->failed = 1;
+        r->depth -= 1;
+    }
+    return ref(b);
+}
+
+static void get_value_fields(struct reader *r, struct value *v) {
+    unsigned int tag = get_u32(r);
+
+    v->info = get_info(r);
+    switch (tag) {
+    case V_STRING:
+        v->tag = tag;
+        v->string = get_string(r);
+        break;
+    case V_REGEXP:
+        v->tag = tag;
+        v->regexp = get_regexp(r);
+        break;
+    case V_LENS:
+        v->tag = tag;
+        v->lens = get_lens(r);
+        break;
+    case V_FILTER:
+        v->tag = tag;
+        v->filter = get_filter(r);
+        break;
+    case V_TRANSFORM:
+        v->tag = tag;
+        v->transform = get_transform(r);
+        break;
+    case V_CLOS:
+        v->tag = tag;
+        v->func = get_term(r);
+        v->bindings = get_binding(r);
+        break;
+    case V_UNIT:
+        break;
+    default:
+        r->failed = 1;
+        break;
+    }
+}
+
+static struct value *get_value(struct reader *r) {
+    struct value *v = NULL;
+
+    if (get_ref(r, K_VALUE, (void **) &v) && new_obj(r, v, K_VALUE) == 0) {
+        /* FREE_VALUE needs a valid tag */
+        v->tag = V_UNIT;
+        r->depth += 1;
+        get_value_fields(r, v);
+        r->depth -= 1;
+    }
+    return ref(v);
+}
+
+/* Drop the reader's reference to every object it created. Objects that
+ * made it into the module survive, everything else is freed */
+static void release_objs(struct reader *r) {
+    for (size_t i=0; i < r->nobjs; i++) {
+        void *p = r->objs[i];
+        switch (r->kinds[i]) {
+        case K_STRING: {
+            struct string *s = p;
+            unref(s, string);
+            break;
+        }
+        case K_INFO: {
+            struct info *info = p;
+            unref(info, info);
+            break;
+        }
+        case K_REGEXP: {
+            struct regexp *re = p;
+            unref(re, regexp);
+            break;
+        }
+        case K_LENS: {
+            struct lens *l = p;
+            unref(l, lens);
+            break;
+        }
+        case K_TYPE: {
+            struct type *t = p;
+            unref(t, type);
+            break;
+        }
+        case K_TERM: {
+            struct term *term = p;
+            unref(term, term);
+            break;
+        }
+        case K_PARAM: {
+            struct param *param = p;
+            unref(param, param);
+            break;
+        }
+        case K_BINDING: {
+            struct binding *b = p;
+            unref(b, binding);
+            break;
+        }
+        case K_VALUE: {
+            struct value *v = p;
+            unref(v, value);
+            break;
+        }
+        case K_FILTER: {
+            struct filter *f = p;
+            unref(f, filter);
+            break;
+        }
+        case K_TRANSFORM: {
+            struct transform *xform = p;
+            unref(xform, transform);
+            break;
+        }
+        default:
+            assert(0);
+            break;
+        }
+    }
+    free(r->objs);
+    free(r->kinds);
+}
+
+/* Check the header in R against the current library, flags and sources.
+ * Return the module name from the header on success, NULL if the file
+ * can not be used */
+static char *check_header(struct reader *r, const char *filename,
+                          struct module *deps) {
+    char *version = NULL, *name = NULL, *dep = NULL;
+    uint32_t flags, ndeps;
+    uint64_t d, expected;
+
+    if (r->len < CACHE_MAGIC_LEN
+        || memcmp(r->buf, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0)
+        goto error;
+    r->pos = CACHE_MAGIC_LEN;
+    if (get_u32(r) != CACHE_FORMAT)
+        goto error;
+    version = get_str(r);
+    if (version == NULL || STRNEQ(version, PACKAGE_VERSION))
+        goto error;
+    /* An entry compiled with typechecking can be used without, but not
+     * the other way around */
+    flags = get_u32(r);
+    if ((r->hera->flags & CACHE_FLAGS) & ~flags)
+        goto error;
+    name = get_str(r);
+    if (name == NULL)
+        goto error;
+    d = get_u64(r);
+    if (r->failed || source_digest(r->hera->cache, filename, &expected) < 0
+        || d != expected)
+        goto error;
+
+    ndeps = get_u32(r);
+    for (int i=0; i < ndeps && !r->failed; i++) {
+        dep = get_str(r);
+        d = get_u64(r);
+        if (dep == NULL || module_digest(r->hera, dep, &expected) < 0
+            || d != expected)
+            goto error;
+        if (argz_add(&deps->depz, &deps->ndepz, dep) != 0)
+            goto error;
+        FREE(dep);
+    }
+    if (r->failed)
+        goto error;
+    free(version);
+    return name;
+ error:
+    free(version);
+    free(name);
+    free(dep);
+    return NULL;
+}
+
+struct module *cache_load(struct heracles *hera, const char *filename) {
+    struct reader r;
+    struct file_map fm;
+    struct module *module = NULL;
+    char *path = NULL, *name = NULL;
+    uint64_t d = 0;
+
+    if (hera->cache == NULL)
+        return NULL;
+
+    MEMZERO(&r, 1);
+    MEMZERO(&fm, 1);
+    path = cache_filename(hera->cache, filename);
+    if (path == NULL || map_file(path, &fm) < 0)
+        goto done;
+    if (fm.len < CACHE_MAGIC_LEN + sizeof(d))
+        goto done;
+
+    r.buf = fm.text;
+    r.len = fm.len - sizeof(d);
+    r.hera = hera;
+    r.builtin = module_lookup(hera, builtin_module);
+    if (r.builtin == NULL)
+        goto done;
+    for (int i=0; i < sizeof(d); i++)
+        d |= (uint64_t) (unsigned char) fm.text[r.len + i] << (8*i);
+    if (d != digest(FNV_OFFSET, r.buf, r.len))
+        goto done;
+
+    module = module_create("");
+    if (module == NULL)
+        goto done;
+    name = check_header(&r, filename, module);
+    if (name == NULL)
+        goto done;
+    free(module->name);
+    module->name = name;
+
+    module->bindings = get_binding(&r);
+    module->autoload = get_transform(&r);
+    if (r.pos != r.len)
+        r.failed = 1;
+
+ done:
+    release_objs(&r);
+    if (module != NULL && (name == NULL || r.failed))
+        unref(module, module);
+    unmap_file(&fm);
+    free(path);
+    return module;
+}
+
+int cache_init(struct heracles *hera) {
+    const char *dir = getenv(HERACLES_CACHE_ENV);
+    struct module_cache *cache = NULL;
+    struct stat st;
+
+    if (dir == NULL || *dir == '\0')
+        return 0;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+        return 0;
+
+    if (ALLOC(cache) < 0)
+        goto error;
+    cache->dir = strdup(dir);
+    if (cache->dir == NULL)
+        goto error;
+    cache->digests = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    if (cache->digests == NULL)
+        goto error;
+    hash_set_allocator(cache->digests, NULL, digest_node_free, NULL);
+    hera->cache = cache;
+    return 0;
+ error:
+    if (cache != NULL)
+        free(cache->dir);
+    free(cache);
+    return -1;
+}
+
+void cache_close(struct heracles *hera) {
+    struct module_cache *cache = hera->cache;
+
+    if (cache == NULL)
+        return;
+    hash_free_nodes(cache->digests);
+    hash_destroy(cache->digests);
+    free(cache->dir);
+    free(cache);
+    hera->cache = NULL;
+}
+
+/*
+ * Local variables:
+ *  indent-tabs-mode: nil
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  tab-width: 4
+ * End:
+ */
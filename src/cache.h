@@ -0,0 +1,61 @@
+/*
+ * cache.h: on-disk cache of compiled modules
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "syntax.h"
+
+/* The cache keeps one file per module in the directory named by
+ * HERACLES_CACHE_ENV. Each file holds the module's bindings exactly as
+ * COMPILE produced them: the lens graph, regexp patterns and the
+ * ctype/atype/ktype/vtype of every lens, together with the closures and
+ * types needed to use the module from other modules.
+ *
+ * A cache file is only used if it was written by the same library
+ * version, and if neither the module's source nor the source of any
+ * module it was built from has changed since. Anything else, including a
+ * damaged file, makes us quietly compile from source and rewrite the
+ * cache file.
+ */
+
+/* Set up HERA->CACHE if HERACLES_CACHE_ENV names a directory. Return -1
+ * on allocation failure, 0 otherwise */
+int cache_init(struct heracles *hera);
+void cache_close(struct heracles *hera);
+
+/* Return the module compiled from FILENAME if there is a usable cache
+ * entry for it, and NULL otherwise. The caller owns the module. */
+struct module *cache_load(struct heracles *hera, const char *filename);
+
+/* Write MODULE, which was just compiled from FILENAME, to the cache.
+ * Failures are not reported; we simply do without the cache entry. */
+void cache_store(struct heracles *hera, const char *filename,
+                 struct module *module);
+
+#endif
+
+
+/*
+ * Local variables:
+ *  indent-tabs-mode: nil
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  tab-width: 4
+ * End:
+ */
@@ -33,6 +33,9 @@
 #include <limits.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "internal.h"
 #include "memory.h"
@@ -4418,6 +4421,262 @@ int fa_expand_nocase(const char *regexp, size_t regexp_len,
     return result;
 }
 
+/*
+ * Matching with a lazily built DFA
+ *
+ * Determinizing the large automata that lenses produce upfront can take a
+ * long time and lots of memory, even though a match only ever visits a
+ * handful of the states of the DFA. We therefore only build a DFA state,
+ * i.e. the set of FA states we can be in, once a match reaches it, and
+ * fill in its transitions one character at a time.
+ *
+ * Matches from several threads share one DFA. Only adding a transition or
+ * a state takes the lock of the DFA; a transition is published with a
+ * release store once the state it leads to is complete, and states never
+ * move, so matches follow known transitions without locking.
+ */
+
+/* Bound on the memory a DFA can use; each state takes up about 1k */
+#define FA_DFA_MAX_STATES 1024
+
+/* States are kept in blocks of this many, which are never moved or freed
+ * before the DFA is */
+#define DFA_BLOCK_SIZE 32
+#define DFA_NBLOCKS    (FA_DFA_MAX_STATES / DFA_BLOCK_SIZE)
+
+#define DFA_UNKNOWN    -1   /* Transition not computed yet */
+#define DFA_DEAD       -2   /* Transition to the empty set of states */
+#define DFA_GIVE_UP    -3   /* Can't match this character, see fa.h */
+
+struct dfa_state {
+    struct state_set *set;
+    unsigned int      accept : 1;
+    int               next[UCHAR_NUM];
+};
+
+struct fa_dfa {
+    pthread_mutex_t    lock;      /* Held while states and transitions
+                                     are added */
+    struct fa         *fa;
+    bool               multibyte;
+    unsigned int       nstates;
+    struct dfa_state **blocks[DFA_NBLOCKS];
+    hash_t            *index;     /* Maps a state_set to its dfa_state */
+};
+
+static struct dfa_state *dfa_state(struct fa_dfa *dfa, int n) {
+    return dfa->blocks[n / DFA_BLOCK_SIZE][n % DFA_BLOCK_SIZE];
+}
+
+/* Add a DFA state for SET, which is sorted, unless we already have one.
+ * SET is used up. Return the index of the state, or DFA_GIVE_UP if we
+ * have too many states or run out of memory. Must be called with
+ * DFA->LOCK held */
+static int dfa_add_state(struct fa_dfa *dfa, struct state_set *set) {
+    struct dfa_state *d = NULL;
+    hnode_t *node = hash_lookup(dfa->index, set);
+
+    if (node != NULL) {
+        state_set_free(set);
+        return (intptr_t) hnode_get(node);
+    }
+
+    if (dfa->nstates == FA_DFA_MAX_STATES)
+        goto error;
+    if (dfa->nstates % DFA_BLOCK_SIZE == 0)
+        F(ALLOC_N(dfa->blocks[dfa->nstates / DFA_BLOCK_SIZE],
+                  DFA_BLOCK_SIZE));
+    F(ALLOC(d));
+    d->set = set;
+    for (int i=0; i < set->used; i++)
+        d->accept |= set->states[i]->accept;
+    for (int c=0; c < UCHAR_NUM; c++)
+        d->next[c] = DFA_UNKNOWN;
+    /* We can't tell whether '.' and negated character sets match NUL the
+     * way the regexp engine does; in a multibyte locale, it matches whole
+     * characters rather than bytes */
+    d->next[0] = DFA_GIVE_UP;
+    if (dfa->multibyte)
+        for (int c=0x80; c < UCHAR_NUM; c++)
+            d->next[c] = DFA_GIVE_UP;
+
+    F(hash_alloc_insert(dfa->index, set, (void *) (intptr_t) dfa->nstates));
+    dfa->blocks[dfa->nstates / DFA_BLOCK_SIZE][dfa->nstates % DFA_BLOCK_SIZE]
+        = d;
+    __atomic_store_n(&dfa->nstates, dfa->nstates + 1, __ATOMIC_RELEASE);
+    return dfa->nstates - 1;
+ error:
+    free(d);
+    state_set_free(set);
+    return DFA_GIVE_UP;
+}
+
+/* Compute the transition from D on C. Must be called with DFA->LOCK
+ * held */
+static int dfa_step(struct fa_dfa *dfa, struct dfa_state *d, uchar c) {
+    struct state_set *set = state_set_init(-1, S_SORTED);
+    uchar lc = dfa->fa->nocase ? tolower(c) : c;
+    int n;
+
+    if (set == NULL)
+        return DFA_GIVE_UP;
+    for (int i=0; i < d->set->used; i++) {
+        for_each_trans(t, d->set->states[i]) {
+            if (t->min <= lc && lc <= t->max) {
+                if (state_set_add(set, t->to) < 0)
+                    goto error;
+            }
+        }
+    }
+    if (set->used == 0) {
+        state_set_free(set);
+        n = DFA_DEAD;
+    } else {
+        n = dfa_add_state(dfa, set);
+    }
+    /* Remember the transition unless we gave up on it for lack of room;
+     * a later match might have better luck */
+    if (n != DFA_GIVE_UP)
+        __atomic_store_n(&d->next[c], n, __ATOMIC_RELEASE);
+    return n;
+ error:
+    state_set_free(set);
+    return DFA_GIVE_UP;
+}
+
+/* Return the transition from D on C, computing it if we have to */
+static int dfa_next(struct fa_dfa *dfa, struct dfa_state *d, uchar c) {
+    int n = __atomic_load_n(&d->next[c], __ATOMIC_ACQUIRE);
+
+    if (n == DFA_UNKNOWN) {
+        pthread_mutex_lock(&dfa->lock);
+        /* Another match might have computed it in the meantime */
+        n = __atomic_load_n(&d->next[c], __ATOMIC_RELAXED);
+        if (n == DFA_UNKNOWN)
+            n = dfa_step(dfa, d, c);
+        pthread_mutex_unlock(&dfa->lock);
+    }
+    return n;
+}
+
+static void dfa_index_free(hnode_t *node, ATTRIBUTE_UNUSED void *ctx) {
+    free(node);
+}
+
+struct fa_dfa *fa_dfa_make(struct fa *fa) {
+    struct fa_dfa *dfa = NULL;
+    struct state_set *ini = NULL;
+
+    if (fa == NULL || ALLOC(dfa) < 0)
+        goto error;
+    pthread_mutex_init(&dfa->lock, NULL);
+    dfa->fa = fa;
+    dfa->multibyte = MB_CUR_MAX > 1;
+    dfa->index = hash_create(HASHCOUNT_T_MAX, set_cmp, set_hash);
+    if (dfa->index == NULL)
+        goto error;
+    hash_set_allocator(dfa->index, NULL, dfa_index_free, NULL);
+
+    ini = state_set_init(-1, S_SORTED);
+    if (ini == NULL || state_set_add(ini, fa->initial) < 0) {
+        state_set_free(ini);
+        goto error;
+    }
+    if (dfa_add_state(dfa, ini) < 0)
+        goto error;
+    return dfa;
+ error:
+    if (dfa == NULL)
+        fa_free(fa);
+    else
+        fa_dfa_free(dfa);
+    return NULL;
+}
+
+void fa_dfa_free(struct fa_dfa *dfa) {
+    if (dfa == NULL)
+        return;
+    if (dfa->index != NULL) {
+        hash_free_nodes(dfa->index);
+        hash_destroy(dfa->index);
+    }
+    for (int i=0; i < dfa->nstates; i++) {
+        struct dfa_state *d = dfa_state(dfa, i);
+        state_set_free(d->set);
+        free(d);
+    }
+    for (int i=0; i < DFA_NBLOCKS; i++)
+        free(dfa->blocks[i]);
+    fa_free(dfa->fa);
+    pthread_mutex_destroy(&dfa->lock);
+    free(dfa);
+}
+
+int fa_dfa_match(struct fa_dfa *dfa, const char *text, size_t len) {
+    struct dfa_state *d = dfa_state(dfa, 0);
+    int result = -1;
+
+    if (d->accept)
+        result = 0;
+    for (size_t i=0; i < len; i++) {
+        int n = dfa_next(dfa, d, text[i]);
+        if (n == DFA_DEAD)
+            break;
+        if (n == DFA_GIVE_UP) {
+            result = -2;
+            break;
+        }
+        d = dfa_state(dfa, n);
+        if (d->accept)
+            result = i + 1;
+    }
+    return result;
+}
+
+int fa_dfa_run(struct fa_dfa *dfa, int state,
+               const char *const *pieces, size_t npieces, int *accept) {
+    struct dfa_state *d;
+
+    if (state < 0 || state >= __atomic_load_n(&dfa->nstates, __ATOMIC_ACQUIRE))
+        return -2;
+    d = dfa_state(dfa, state);
+    for (size_t p=0; p < npieces; p++) {
+        for (const char *s = pieces[p]; *s != '\0'; s++) {
+            int n = dfa_next(dfa, d, *s);
+            if (n == DFA_DEAD)
+                return -1;
+            if (n == DFA_GIVE_UP)
+                return -2;
+            state = n;
+            d = dfa_state(dfa, n);
+        }
+    }
+    *accept = d->accept;
+    return state;
+}
+
+int fa_dfa_prefix(struct fa_dfa *dfa, const char *text, size_t len,
+                  const char *tail, size_t tail_len, size_t *count) {
+    struct dfa_state *d = dfa_state(dfa, 0);
+    int result = d->accept ? 0 : -1;
+
+    *count = 0;
+    for (size_t i=0; i < len + tail_len; i++) {
+        uchar c = i < len ? text[i] : tail[i - len];
+        int n = dfa_next(dfa, d, c);
+        if (n == DFA_DEAD)
+            break;
+        if (n == DFA_GIVE_UP)
+            return -2;
+        d = dfa_state(dfa, n);
+        if (d->accept) {
+            *count = i + 1;
+            result = 0;
+        }
+    }
+    return result;
+}
+
 static void print_char(FILE *out, uchar c) {
     /* We escape '/' as '\\/' since dot chokes on bare slashes in labels;
        Also, a space ' ' is shown as '\s' */
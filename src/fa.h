@@ -267,6 +267,53 @@ int fa_expand_nocase(const char *regexp, size_t regexp_len,
  */
 int fa_enumerate(struct fa *fa, int limit, char ***words);
 
+/* A matcher that finds the longest prefix of a string accepted by an FA,
+ * building the states of the equivalent DFA as matches need them. It can
+ * be used from several threads at once.
+ */
+struct fa_dfa;
+
+/* Make a matcher for FA, which is used up and must not be used by the
+ * caller any more. Return NULL if we run out of memory.
+ */
+struct fa_dfa *fa_dfa_make(struct fa *fa);
+
+void fa_dfa_free(struct fa_dfa *dfa);
+
+/* Return the length of the longest prefix of the LEN characters at TEXT
+ * that DFA accepts, and -1 if there is none.
+ *
+ * Return -2 if we can't tell: when the match would need more DFA states
+ * than we are willing to build, when we run out of memory, and when the
+ * match reaches a NUL character, since regexp engines disagree on
+ * whether '.' matches NUL, or, if the locale uses multibyte characters
+ * when FA_DFA_MAKE is called, a non-ASCII character.
+ */
+int fa_dfa_match(struct fa_dfa *dfa, const char *text, size_t len);
+
+/* Run DFA over the NPIECES NUL-terminated strings in PIECES, one after the
+ * other, starting in STATE. STATE is 0 for the initial state, or what an
+ * earlier call returned; this makes it possible to match a text that is
+ * never put together in one string.
+ *
+ * Return the state reached and set *ACCEPT to 1 if the DFA accepts the
+ * text read so far, to 0 otherwise. Return -1 if no text that starts with
+ * what was read can be accepted, and -2 if we can't tell, for the same
+ * reasons as FA_DFA_MATCH.
+ */
+int fa_dfa_run(struct fa_dfa *dfa, int state,
+               const char *const *pieces, size_t npieces, int *accept);
+
+/* Set *COUNT to the length of the longest prefix of the LEN characters at
+ * TEXT, followed by the TAIL_LEN characters at TAIL, that DFA accepts.
+ * Nothing is copied, so neither TEXT nor TAIL need be NUL-terminated.
+ *
+ * Return 0 if there is such a prefix, -1 if there is none, and -2 if we
+ * can't tell, for the same reasons as FA_DFA_MATCH.
+ */
+int fa_dfa_prefix(struct fa_dfa *dfa, const char *text, size_t len,
+                  const char *tail, size_t tail_len, size_t *count);
+
 #endif
 
 
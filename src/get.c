@@ -47,10 +47,37 @@ struct state {
     struct info      *info;
     struct span      *span;
     const char       *text;
+    uint              text_len;  /* TEXT need not be NUL-terminated */
+    bool              nl;        /* The lens sees a newline after TEXT,
+                                    which TEXT_LEN counts, see init_text */
+    char             *text_nl;   /* TEXT with that newline, made by the
+                                    first match that needs it, see MATCH */
     struct seq       *seqs;
     char             *key;
     char             *value;     /* GET_STORE leaves a value here */
     struct lns_error *error;
+    /* If PARSE is set, get also builds the skeleton and dictionary that
+     * parse would build for the same text. GET_LENS leaves them for the
+     * lens it just processed in SKEL and DICT */
+    bool              parse;
+    struct skel      *skel;
+    struct dict      *dict;
+    /* If EMIT is set, the trees for the iterations of the toplevel L_STAR
+     * are passed to it one by one instead of being collected. If it has a
+     * BUILDER, no tree is made at all; GET_SUBTREE tells the builder
+     * about each node instead */
+    struct emit      *emit;
+    /* If ARENA is set, the nodes, keys, values and spans of the tree come
+     * from it */
+    struct tree_arena *arena;
+    /* If SLICES is set, it is a copy of TEXT in ARENA, and values point
+     * into it instead of being copied one by one where we can. The values
+     * cut out of it so far, with the NULs that end them, all lie within
+     * [SLICES_START, SLICES_END); that range is empty while SLICES_END is
+     * 0 */
+    char             *slices;
+    uint              slices_start;
+    uint              slices_end;
     /* We use the registers from a regular expression match to keep track
      * of the substring we are currently looking at. REGS are the registers
      * from the last regexp match; NREG is the number of the register
@@ -66,27 +93,47 @@ struct state {
      */
     struct re_registers *regs;
     uint                 nreg;
+    /* Matches nest, so their registers come and go like a stack. Rather
+     * than allocating registers for every match, we keep them in
+     * REG_POOL for reuse; the first REG_DEPTH of them are in use */
+    struct reg_set     **reg_pool;
+    uint                 reg_depth;
+    uint                 reg_pool_size;
 };
 
+/* Registers in the pool of a STATE */
+struct reg_set {
+    struct re_registers  regs;
+    uint                 size;   /* Room in REGS.START and REGS.END */
+};
+
+/* Where a streaming get sends its trees: whole toplevel nodes go to FN,
+ * single nodes to BUILDER */
+struct emit {
+    hera_emit_t                 fn;
+    const struct hera_builder  *builder;
+    void                       *data;
+    bool                        stopped;  /* FN or BUILDER asked us to stop */
+};
+
+static bool building(struct state *state) {
+    return state->emit != NULL && state->emit->builder != NULL;
+}
+
 /* Used by recursive lenses to stack intermediate results */
 struct frame {
     struct lens     *lens;
     char            *key;
     struct span     *span;
-    union {
-        struct { /* MGET */
-            char        *value;
-            struct tree *tree;
-        };
-        struct { /* M_PARSE */
-            struct skel *skel;
-            struct dict *dict;
-        };
-    };
+    char            *value;  /* M_GET */
+    struct tree     *tree;   /* M_GET */
+    struct skel     *skel;   /* M_PARSE */
+    struct dict     *dict;   /* M_PARSE */
 };
 
-/* Used by recursive lenses in get_rec and parse_rec */
-enum mode_t { M_GET, M_PARSE };
+/* Used by recursive lenses in get_rec and parse_rec. A get that also
+ * parses uses M_GET|M_PARSE */
+enum mode_t { M_GET = 1, M_PARSE = 2 };
 
 /* Abstract Syntax Tree for recursive parse */
 struct ast {
@@ -113,7 +160,6 @@ struct rec_state {
 #define REG_START(state) ((state)->regs->start[(state)->nreg])
 #define REG_END(state)   ((state)->regs->end[(state)->nreg])
 #define REG_SIZE(state) (REG_END(state) - REG_START(state))
-#define REG_POS(state) ((state)->text + REG_START(state))
 #define REG_VALID(state) ((state)->regs != NULL &&                      \
                           (state)->nreg < (state)->regs->num_regs)
 #define REG_MATCHED(state) (REG_VALID(state)                            \
@@ -223,25 +269,111 @@ void free_lns_error(struct lns_error *err) {
         return;
     free(err->message);
     free(err->path);
+    free(err->text);
     unref(err->lens, lens);
     free(err);
 }
 
-static void vget_error(struct state *state, struct lens *lens,
-                       const char *format, va_list ap) {
-    int r;
+const char *lns_error_message(struct lns_error *err) {
+    struct lens *lens;
+    char *pat = NULL, *text = NULL;
 
-    if (state->error != NULL)
+    if (err == NULL)
+        return NULL;
+    if (err->message != NULL || err->kind == LNS_ERROR_MESSAGE)
+        return err->message;
+
+    lens = err->lens;
+    switch (err->kind) {
+    case LNS_ERROR_EXPECTED:
+        pat = escape(lens->ctype->pattern->str, -1, NULL);
+        if (pat != NULL)
+            xasprintf(&err->message, "expected %s at '%s'", pat, err->text);
+        break;
+    case LNS_ERROR_NO_MATCH: {
+        const char *lname = "(lname)";
+        if (lens->tag == L_KEY)
+            lname = "key";
+        else if (lens->tag == L_DEL)
+            lname = "del";
+        else if (lens->tag == L_STORE)
+            lname = "store";
+        pat = regexp_escape(lens->ctype);
+        if (pat != NULL)
+            xasprintf(&err->message, "no match for %s /%s/", lname, pat);
+        break;
+    }
+    case LNS_ERROR_TREE:
+        lns_format_atype(lens, &pat);
+        if (err->text != NULL)
+            text = enc_format(err->text, strlen(err->text));
+        if (err->count == -1) {
+            xasprintf(&err->message,
+                      "Failed to match \n    %s\n  with tree\n   %s",
+                      pat, text);
+        } else if (err->count == -2) {
+            xasprintf(&err->message,
+                      "Internal error matching\n    %s\n  with tree\n   %s",
+                      pat, text);
+        } else {
+            /* Should have been cheraht by the typechecker */
+            xasprintf(&err->message,
+                      "Syntax error in tree schema\n    %s", pat);
+        }
+        break;
+    case LNS_ERROR_STORE:
+        pat = regexp_escape(lens->regexp);
+        if (pat != NULL)
+            xasprintf(&err->message,
+                      "Value '%s' does not match regexp /%s/ in store lens",
+                      err->text, pat);
+        break;
+    default:
+        break;
+    }
+    free(pat);
+    free(text);
+    return err->message;
+}
+
+void free_lns_parse(struct lns_parse *parse) {
+    if (parse == NULL)
         return;
+    free_skel(parse->skel);
+    free_dict(parse->dict);
+    unref(parse->lens, lens);
+    free(parse);
+}
+
+/* Record an error of KIND for LENS in STATE and return it, or return NULL
+ * if STATE already has an error */
+static struct lns_error *make_get_error(struct state *state,
+                                        struct lens *lens,
+                                        enum lns_error_kind kind) {
+    if (state->error != NULL)
+        return NULL;
     CALLOC(state->error, 1);
+    if (state->error == NULL)
+        return NULL;
+    state->error->kind = kind;
     state->error->lens = ref(lens);
     if (REG_MATCHED(state))
         state->error->pos  = REG_END(state);
     else
         state->error->pos = 0;
-    r = vasprintf(&state->error->message, format, ap);
+    return state->error;
+}
+
+static void vget_error(struct state *state, struct lens *lens,
+                       const char *format, va_list ap) {
+    struct lns_error *err = make_get_error(state, lens, LNS_ERROR_MESSAGE);
+    int r;
+
+    if (err == NULL)
+        return;
+    r = vasprintf(&err->message, format, ap);
     if (r == -1)
-        state->error->message = NULL;
+        err->message = NULL;
 }
 
 static void get_error(struct state *state, struct lens *lens,
@@ -262,6 +394,13 @@ static struct skel *make_skel(struct lens *lens) {
     return skel;
 }
 
+/* When get also parses, leave the skeleton of LENS in STATE. This is all
+ * parse produces for lenses without sublenses */
+static void get_skel(struct lens *lens, struct state *state) {
+    if (state->parse)
+        state->skel = make_skel(lens);
+}
+
 void free_skel(struct skel *skel) {
     if (skel == NULL)
         return;
@@ -334,23 +473,44 @@ static void print_dict(struct dict *dict, int indent) {
 }
 #endif
 
+/* Return true if the text from START to END takes in the newline that
+ * STATE->NL stands for */
+static bool reaches_nl(struct state *state, uint start, uint end) {
+    return state->nl && start < end && end == state->text_len;
+}
+
+/* Copy the text from START to END, with the newline that STATE->NL stands
+ * for if it reaches that far */
+static char *token_range(struct state *state, uint start, uint end) {
+    char *s;
+
+    if (! reaches_nl(state, start, end))
+        return strndup(state->text + start, end - start);
+    if (ALLOC_N(s, end - start + 1) < 0)
+        return NULL;
+    memcpy(s, state->text + start, end - start - 1);
+    s[end - start - 1] = '\n';
+    return s;
+}
+
 static void get_expected_error(struct state *state, struct lens *l) {
     /* Size of the excerpt of the input text we'll show */
     static const int wordlen = 10;
-    char word[wordlen+1];
-    char *p, *pat;
-
-    if (REG_MATCHED(state))
-        strncpy(word, REG_POS(state), wordlen);
-    else
-        strncpy(word, state->text, wordlen);
-    word[wordlen] = '\0';
-    for (p = word; *p != '\0' && *p != '\n'; p++);
-    *p = '\0';
+    struct lns_error *err;
+    char *p;
+    uint start = REG_MATCHED(state) ? REG_START(state) : 0;
+    uint n = start < state->text_len ? state->text_len - start : 0;
 
-    pat = escape(l->ctype->pattern->str, -1, NULL);
-    get_error(state, l, "expected %s at '%s'", pat, word);
-    free(pat);
+    err = make_get_error(state, l, LNS_ERROR_EXPECTED);
+    if (err == NULL)
+        return;
+    if (n > wordlen)
+        n = wordlen;
+    err->text = token_range(state, start, start + n);
+    if (err->text != NULL) {
+        for (p = err->text; *p != '\0' && *p != '\n'; p++);
+        *p = '\0';
+    }
 }
 
 /*
@@ -359,20 +519,98 @@ static void get_expected_error(struct state *state, struct lens *l) {
 
 static char *token(struct state *state) {
     ensure0(REG_MATCHED(state), state->info);
-    return strndup(REG_POS(state), REG_SIZE(state));
+    return token_range(state, REG_START(state), REG_END(state));
+}
+
+/* Copy LEN bytes at S for use as a value in the tree */
+static char *tree_strndup(struct state *state, const char *s, size_t len) {
+    if (state->arena != NULL)
+        return tree_arena_strndup(state->arena, s, len);
+    return strndup(s, len);
+}
+
+/* Like TREE_STRNDUP, for a label. Labels in an arena are interned */
+static char *tree_label(struct state *state, const char *s, size_t len) {
+    if (state->arena != NULL)
+        return tree_arena_intern(state->arena, s, len);
+    return strndup(s, len);
+}
+
+static void tree_strfree(struct state *state, char *s) {
+    if (state->arena == NULL)
+        free(s);
+}
+
+/* Copy the text from START to END with DUP, which is TREE_STRNDUP or
+ * TREE_LABEL */
+static char *tree_range(struct state *state, uint start, uint end,
+                        char *(*dup)(struct state *, const char *, size_t)) {
+    char *buf, *s;
+
+    if (! reaches_nl(state, start, end))
+        return dup(state, state->text + start, end - start);
+    buf = token_range(state, start, end);
+    if (buf == NULL)
+        return NULL;
+    s = dup(state, buf, end - start);
+    free(buf);
+    return s;
+}
+
+/* Like TOKEN, for a value in the tree. With SLICES, the value is
+ * terminated in place by overwriting the byte after it, unless that could
+ * clobber an earlier value. Values come in the order in which they appear
+ * in the text, or in the reverse order for recursive lenses, so we rarely
+ * have to copy one */
+static char *tree_token(struct state *state) {
+    ensure0(REG_MATCHED(state), state->info);
+    if (state->slices != NULL) {
+        uint start = REG_START(state), end = REG_END(state);
+
+        if (state->slices_end == 0 || start >= state->slices_end
+            || end < state->slices_start) {
+            if (state->slices_end == 0 || end < state->slices_start)
+                state->slices_start = start;
+            if (start >= state->slices_end)
+                state->slices_end = end + 1;
+            state->slices[end] = '\0';
+            return state->slices + start;
+        }
+    }
+    return tree_range(state, REG_START(state), REG_END(state), tree_strndup);
 }
 
-static char *token_range(const char *text, uint start, uint end) {
-    return strndup(text + start, end - start);
+static struct tree *get_make_tree(struct state *state, char *label,
+                                  char *value, struct tree *children) {
+    if (state->arena != NULL)
+        return make_arena_tree(state->arena, label, value, children);
+    return make_tree(label, value, NULL, children);
+}
+
+static struct span *get_make_span(struct state *state) {
+    struct span *span;
+
+    if (state->arena == NULL)
+        return make_span(state->info);
+    span = tree_arena_alloc(state->arena, sizeof(*span));
+    if (span != NULL) {
+        MEMZERO(span, 1);
+        /* UINT_MAX means span is not initialized yet */
+        span->span_start = UINT_MAX;
+    }
+    return span;
 }
 
 static void regexp_match_error(struct state *state, struct lens *lens,
                                int count, struct regexp *r) {
     char *text = NULL;
-    char *pat = regexp_escape(r);
+    char *pat = NULL;
 
+    if (state->error != NULL)
+        return;
+    pat = regexp_escape(r);
     if (state->regs != NULL)
-        text = strndup(REG_POS(state), REG_SIZE(state));
+        text = token_range(state, REG_START(state), REG_END(state));
     else
         text = strdup("(unknown)");
 
@@ -392,20 +630,65 @@ static void regexp_match_error(struct state *state, struct lens *lens,
 static void no_match_error(struct state *state, struct lens *lens) {
     ensure(lens->tag == L_KEY || lens->tag == L_DEL
            || lens->tag == L_STORE, state->info);
-    char *pat = regexp_escape(lens->ctype);
-    const char *lname = "(lname)";
-    if (lens->tag == L_KEY)
-        lname = "key";
-    else if (lens->tag == L_DEL)
-        lname = "del";
-    else if (lens->tag == L_STORE)
-        lname = "store";
-    get_error(state, lens, "no match for %s /%s/", lname, pat);
-    free(pat);
+    make_get_error(state, lens, LNS_ERROR_NO_MATCH);
  error:
     return;
 }
 
+/* Return registers for a new match from the pool of STATE, or NULL if we
+ * run out of memory. FREE_REGS gives them back */
+static struct reg_set *take_regs(struct state *state) {
+    struct reg_set *set;
+
+    if (state->reg_depth == state->reg_pool_size) {
+        uint size = state->reg_pool_size == 0 ? 8 : 2 * state->reg_pool_size;
+        if (REALLOC_N(state->reg_pool, size) < 0)
+            return NULL;
+        MEMZERO(state->reg_pool + state->reg_pool_size,
+                size - state->reg_pool_size);
+        state->reg_pool_size = size;
+    }
+    set = state->reg_pool[state->reg_depth];
+    if (set == NULL) {
+        if (ALLOC(set) < 0)
+            return NULL;
+        state->reg_pool[state->reg_depth] = set;
+    }
+    state->reg_depth += 1;
+    return set;
+}
+
+static void free_reg_pool(struct state *state) {
+    for (uint i=0; i < state->reg_pool_size; i++) {
+        struct reg_set *set = state->reg_pool[i];
+        if (set != NULL) {
+            free(set->regs.start);
+            free(set->regs.end);
+            free(set);
+        }
+    }
+    FREE(state->reg_pool);
+}
+
+/* Match RE against the text up to SIZE, which takes in the newline that
+ * STATE->NL stands for. When REGEXP_MATCH_2 can't do that without
+ * copying the text, match on STATE->TEXT_NL, which is made only once */
+static int match_nl(struct state *state, struct regexp *re,
+                    uint size, uint start, struct re_registers *regs) {
+    int count;
+
+    count = regexp_match_2(re, state->text, size - 1, "\n", 1, start, regs);
+    if (count != -4)
+        return count;
+    if (state->text_nl == NULL) {
+        if (ALLOC_N(state->text_nl, size) < 0)
+            return -2;
+        memcpy(state->text_nl, state->text, size - 1);
+        state->text_nl[size - 1] = '\n';
+    }
+    return regexp_match(re, state->text_nl, size, start, regs);
+}
+
 /* Modifies STATE->REGS and STATE->NREG. The caller must save these
  * if they are still needed
  *
@@ -413,28 +696,39 @@ static void no_match_error(struct state *state, struct lens *lens) {
  */
 static int match(struct state *state, struct lens *lens,
                  struct regexp *re, uint size, uint start) {
-    struct re_registers *regs;
+    struct reg_set *set;
     int count;
 
-    if (ALLOC(regs) < 0)
+    set = take_regs(state);
+    if (set == NULL)
         return -1;
 
-    count = regexp_match(re, state->text, size, start, regs);
+    /* The regexp matcher only grows START and END when NUM_REGS is too
+     * small; afterwards, NUM_REGS must only count the registers of RE,
+     * as it would for registers that were fresh */
+    set->regs.num_regs = set->size;
+    if (reaches_nl(state, start, size))
+        count = match_nl(state, re, size, start, &set->regs);
+    else
+        count = regexp_match(re, state->text, size, start, &set->regs);
+    if (set->regs.num_regs > set->size)
+        set->size = set->regs.num_regs;
     if (count < -1) {
         regexp_match_error(state, lens, count, re);
-        FREE(regs);
+        state->reg_depth -= 1;
         return -1;
     }
-    state->regs = regs;
+    set->regs.num_regs = (count >= 0) ? regexp_nsub(re) + 2 : 0;
+    state->regs = &set->regs;
     state->nreg = 0;
     return count;
 }
 
+/* Give the registers of the innermost match back to the pool */
 static void free_regs(struct state *state) {
     if (state->regs != NULL) {
-        free(state->regs->start);
-        free(state->regs->end);
-        FREE(state->regs);
+        state->reg_depth -= 1;
+        state->regs = NULL;
     }
 }
 
@@ -468,12 +762,15 @@ static struct seq *find_seq(const char *name, struct state *state) {
 static struct tree *get_seq(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_SEQ, state->info);
     struct seq *seq = find_seq(lens->string->str, state);
+    char num[3 * sizeof(int) + 2];
     int r;
 
-    r = asprintf((char **) &(state->key), "%d", seq->value);
-    ERR_NOMEM(r < 0, state->info);
+    r = snprintf(num, sizeof(num), "%d", seq->value);
+    state->key = tree_label(state, num, r);
+    ERR_NOMEM(state->key == NULL, state->info);
 
     seq->value += 1;
+    get_skel(lens, state);
  error:
     return NULL;
 }
@@ -487,6 +784,7 @@ static struct tree *get_counter(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_COUNTER, state->info);
     struct seq *seq = find_seq(lens->string->str, state);
     seq->value = 1;
+    get_skel(lens, state);
     return NULL;
 }
 
@@ -498,9 +796,11 @@ static struct skel *parse_counter(struct lens *lens, struct state *state) {
 static struct tree *get_del(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_DEL, state->info);
     if (! REG_MATCHED(state)) {
-        char *pat = regexp_escape(lens->ctype);
-        get_error(state, lens, "no match for del /%s/", pat);
-        free(pat);
+        no_match_error(state, lens);
+    } else if (state->parse) {
+        state->skel = make_skel(lens);
+        if (state->skel != NULL)
+            state->skel->text = token(state);
     }
     update_span(state->span, REG_START(state), REG_END(state));
     return NULL;
@@ -529,12 +829,13 @@ static struct tree *get_store(struct lens *lens, struct state *state) {
     else if (! REG_MATCHED(state))
         no_match_error(state, lens);
     else {
-        state->value = token(state);
+        state->value = tree_token(state);
         if (state->span) {
             state->span->value_start = REG_START(state);
             state->span->value_end = REG_END(state);
             update_span(state->span, REG_START(state), REG_END(state));
         }
+        get_skel(lens, state);
     }
     return tree;
 }
@@ -547,7 +848,9 @@ static struct skel *parse_store(struct lens *lens,
 
 static struct tree *get_value(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_VALUE, state->info);
-    state->value = strdup(lens->string->str);
+    state->value = tree_strndup(state, lens->string->str,
+                                strlen(lens->string->str));
+    get_skel(lens, state);
     return NULL;
 }
 
@@ -562,12 +865,14 @@ static struct tree *get_key(struct lens *lens, struct state *state) {
     if (! REG_MATCHED(state))
         no_match_error(state, lens);
     else {
-        state->key = token(state);
+        state->key = tree_range(state, REG_START(state), REG_END(state),
+                                tree_label);
         if (state->span) {
             state->span->label_start = REG_START(state);
             state->span->label_end = REG_END(state);
             update_span(state->span, REG_START(state), REG_END(state));
         }
+        get_skel(lens, state);
     }
     return NULL;
 }
@@ -579,7 +884,9 @@ static struct skel *parse_key(struct lens *lens, struct state *state) {
 
 static struct tree *get_label(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_LABEL, state->info);
-    state->key = strdup(lens->string->str);
+    state->key = tree_label(state, lens->string->str,
+                            strlen(lens->string->str));
+    get_skel(lens, state);
     return NULL;
 }
 
@@ -594,20 +901,23 @@ static struct tree *get_union(struct lens *lens, struct state *state) {
     struct tree *tree = NULL;
     int applied = 0;
     uint old_nreg = state->nreg;
+    const unsigned int *regs = lns_ctype_regs(lens);
 
-    state->nreg += 1;
+    ERR_NOMEM(regs == NULL, state->info);
     for (int i=0; i < lens->nchildren; i++) {
+        state->nreg = old_nreg + regs[i];
         if (REG_MATCHED(state)) {
             tree = get_lens(lens->children[i], state);
             applied = 1;
             break;
         }
-        state->nreg += 1 + regexp_nsub(lens->children[i]->ctype);
     }
     state->nreg = old_nreg;
     if (!applied)
         get_expected_error(state, lens);
     return tree;
+ error:
+    return NULL;
 }
 
 static struct skel *parse_union(struct lens *lens, struct state *state,
@@ -617,60 +927,82 @@ static struct skel *parse_union(struct lens *lens, struct state *state,
     struct skel *skel = NULL;
     int applied = 0;
     uint old_nreg = state->nreg;
+    const unsigned int *regs = lns_ctype_regs(lens);
 
-    state->nreg += 1;
+    ERR_NOMEM(regs == NULL, state->info);
     for (int i=0; i < lens->nchildren; i++) {
         struct lens *l = lens->children[i];
+        state->nreg = old_nreg + regs[i];
         if (REG_MATCHED(state)) {
             skel = parse_lens(l, state, dict);
             applied = 1;
             break;
         }
-        state->nreg += 1 + regexp_nsub(lens->children[i]->ctype);
     }
     state->nreg = old_nreg;
     if (! applied)
         get_expected_error(state, lens);
 
     return skel;
+ error:
+    return NULL;
 }
 
 static struct tree *get_concat(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_CONCAT, state->info);
 
     struct tree *tree = NULL;
+    struct skel *skel = NULL;
+    struct dict *dict = NULL;
     uint old_nreg = state->nreg;
+    const unsigned int *regs = lns_ctype_regs(lens);
+
+    ERR_NOMEM(regs == NULL, state->info);
+    if (state->parse)
+        skel = make_skel(lens);
 
-    state->nreg += 1;
     for (int i=0; i < lens->nchildren; i++) {
         struct tree *t = NULL;
+        state->nreg = old_nreg + regs[i];
         if (! REG_VALID(state)) {
             get_error(state, lens->children[i],
                       "Not enough components in concat");
             free_tree(tree);
+            free_skel(skel);
+            free_dict(dict);
             state->nreg = old_nreg;
             return NULL;
         }
 
         t = get_lens(lens->children[i], state);
         list_append(tree, t);
-        state->nreg += 1 + regexp_nsub(lens->children[i]->ctype);
+        if (state->parse) {
+            list_append(skel->skels, state->skel);
+            dict_append(&dict, state->dict);
+        }
     }
     state->nreg = old_nreg;
+    state->skel = skel;
+    state->dict = dict;
 
     return tree;
+ error:
+    return NULL;
 }
 
 static struct skel *parse_concat(struct lens *lens, struct state *state,
                                  struct dict **dict) {
     ensure0(lens->tag == L_CONCAT, state->info);
-    struct skel *skel = make_skel(lens);
+    struct skel *skel = NULL;
     uint old_nreg = state->nreg;
+    const unsigned int *regs = lns_ctype_regs(lens);
 
-    state->nreg += 1;
+    ERR_NOMEM(regs == NULL, state->info);
+    skel = make_skel(lens);
     for (int i=0; i < lens->nchildren; i++) {
         struct skel *sk = NULL;
         struct dict *di = NULL;
+        state->nreg = old_nreg + regs[i];
         if (! REG_VALID(state)) {
             get_error(state, lens->children[i],
                       "Not enough components in concat");
@@ -681,22 +1013,29 @@ static struct skel *parse_concat(struct lens *lens, struct state *state,
         sk = parse_lens(lens->children[i], state, &di);
         list_append(skel->skels, sk);
         dict_append(dict, di);
-        state->nreg += 1 + regexp_nsub(lens->children[i]->ctype);
     }
     state->nreg = old_nreg;
 
     return skel;
+ error:
+    return NULL;
 }
 
 static struct tree *get_quant_star(struct lens *lens, struct state *state) {
     ensure0(lens->tag == L_STAR, state->info);
     struct lens *child = lens->child;
     struct tree *tree = NULL, *tail = NULL;
+    struct skel *skel = NULL, *stail = NULL;
+    struct dict *dict = NULL;
     struct re_registers *old_regs = state->regs;
     uint old_nreg = state->nreg;
     uint end = REG_END(state);
     uint start = REG_START(state);
     uint size = end - start;
+    bool stopped = false;
+
+    if (state->parse)
+        skel = make_skel(lens);
 
     state->regs = NULL;
     while (size > 0 && match(state, child, child->ctype, end, start) > 0) {
@@ -704,21 +1043,115 @@ static struct tree *get_quant_star(struct lens *lens, struct state *state) {
 
         t = get_lens(lens->child, state);
         list_tail_cons(tree, tail, t);
+        if (state->parse) {
+            list_tail_cons(skel->skels, stail, state->skel);
+            dict_append(&dict, state->dict);
+        }
 
         start += REG_SIZE(state);
         size -= REG_SIZE(state);
         free_regs(state);
+        if (building(state) && state->emit->stopped) {
+            stopped = true;
+            break;
+        }
     }
     free_regs(state);
     state->regs = old_regs;
     state->nreg = old_nreg;
-    if (size != 0) {
+    state->skel = skel;
+    state->dict = dict;
+    if (size != 0 && ! stopped) {
         get_error(state, lens, "%s", short_iteration);
         state->error->pos = start;
     }
     return tree;
 }
 
+/* Tell EMIT->BUILDER that a node starts */
+static void build_begin(struct emit *emit) {
+    if (! emit->stopped && emit->builder->begin_subtree(emit->data) != 0)
+        emit->stopped = true;
+}
+
+/* Tell EMIT->BUILDER about the label and value of the node that ends */
+static void build_end(struct emit *emit, const char *label,
+                      const char *value) {
+    const struct hera_builder *builder = emit->builder;
+
+    if (emit->stopped)
+        return;
+    if ((label != NULL && builder->set_label(emit->data, label) != 0)
+        || (value != NULL && builder->set_value(emit->data, value) != 0)
+        || builder->end_subtree(emit->data) != 0)
+        emit->stopped = true;
+}
+
+/* Pass TREE and its siblings to EMIT->BUILDER as GET_SUBTREE would have */
+static void build_trees(struct emit *emit, struct tree *tree) {
+    list_for_each(t, tree) {
+        build_begin(emit);
+        build_trees(emit, t->children);
+        build_end(emit, t->label, t->value);
+        if (emit->stopped)
+            return;
+    }
+}
+
+/* Pass each node in the list TREE to EMIT->FN on its own, and free the
+ * ones left over once it asks us to stop */
+static void emit_trees(struct emit *emit, struct tree *tree) {
+    while (tree != NULL) {
+        struct tree *next = tree->next;
+        tree->next = NULL;
+        if (emit->stopped)
+            free_tree(tree);
+        else if (emit->fn(emit->data, tree) != 0)
+            emit->stopped = true;
+        tree = next;
+    }
+}
+
+/* Like GET_QUANT_STAR, but each iteration's tree is emitted as soon as it
+ * is complete, so that we never hold more than one of them */
+static void get_stream_star(struct lens *lens, struct state *state) {
+    ensure(lens->tag == L_STAR, state->info);
+    struct lens *child = lens->child;
+    struct emit *emit = state->emit;
+    struct re_registers *old_regs = state->regs;
+    uint old_nreg = state->nreg;
+    uint end = REG_END(state);
+    uint start = REG_START(state);
+    uint size = end - start;
+
+    state->regs = NULL;
+    while (size > 0 && match(state, child, child->ctype, end, start) > 0) {
+        struct tree *t = NULL;
+
+        t = get_lens(lens->child, state);
+        if (state->error != NULL) {
+            free_tree(t);
+            break;
+        }
+        emit_trees(emit, t);
+
+        start += REG_SIZE(state);
+        size -= REG_SIZE(state);
+        free_regs(state);
+        if (emit->stopped)
+            break;
+    }
+    free_regs(state);
+    state->regs = old_regs;
+    state->nreg = old_nreg;
+    if (size != 0 && state->error == NULL && !emit->stopped) {
+        get_error(state, lens, "%s", short_iteration);
+        state->error->pos = start;
+    }
+ error:
+    return;
+}
+
 static struct skel *parse_quant_star(struct lens *lens, struct state *state,
                                      struct dict **dict) {
     ensure0(lens->tag == L_STAR, state->info);
@@ -764,6 +1197,8 @@ static struct tree *get_quant_maybe(struct lens *lens, struct state *state) {
     state->nreg += 1;
     if (REG_MATCHED(state)) {
         tree = get_lens(lens->child, state);
+    } else {
+        get_skel(lens, state);
     }
     state->nreg -= 1;
     return tree;
@@ -794,15 +1229,36 @@ static struct tree *get_subtree(struct lens *lens, struct state *state) {
 
     state->key = NULL;
     state->value = NULL;
-    if (state->info->flags & HERA_ENABLE_SPAN) {
-        state->span = make_span(state->info);
+    if (building(state)) {
+        build_begin(state->emit);
+    } else if (state->info->flags & HERA_ENABLE_SPAN) {
+        state->span = get_make_span(state);
         ERR_NOMEM(state->span == NULL, state->info);
     }
 
     children = get_lens(lens->child, state);
 
-    tree = make_tree(state->key, state->value, NULL, children);
-    tree->span = state->span;
+    if (state->parse) {
+        /* The tree and the dictionary each need their own copy of the
+         * key */
+        char *dkey = NULL;
+        if (state->key != NULL) {
+            dkey = strdup(state->key);
+            ERR_NOMEM(dkey == NULL, state->info);
+        }
+        state->dict = make_dict(dkey, state->skel, state->dict);
+        state->skel = make_skel(lens);
+    }
+
+    if (building(state)) {
+        /* CHILDREN is empty, since our subtrees went to the builder, too */
+        build_end(state->emit, state->key, state->value);
+        tree_strfree(state, state->key);
+        tree_strfree(state, state->value);
+    } else {
+        tree = get_make_tree(state, state->key, state->value, children);
+        tree->span = state->span;
+    }
 
     if (state->span != NULL) {
         update_span(span, state->span->span_start, state->span->span_end);
@@ -873,21 +1329,29 @@ static struct tree *get_square(struct lens *lens, struct state *state) {
     ERR_NOMEM(r < 0, state->info);
 
     tree = get_lens(lens->child, state);
+    if (state->parse) {
+        struct skel *sk = make_skel(lens);
+        if (sk != NULL)
+            sk->skels = state->skel;
+        else
+            free_skel(state->skel);
+        state->skel = sk;
+    }
+
+    const unsigned int *regs = lns_ctype_regs(concat);
+    ERR_NOMEM(regs == NULL, state->info);
 
     /* retrieve left component */
-    state->nreg = 1;
+    state->nreg = regs[0];
     start = REG_START(state);
     end = REG_END(state);
-    lsqr = token_range(state->text, start, end);
+    lsqr = token_range(state, start, end);
 
     /* retrieve right component */
-    /* compute nreg for the last children */
-    for (int i = 0; i < concat->nchildren - 1; i++)
-        state->nreg += 1 + regexp_nsub(concat->children[i]->ctype);
-
+    state->nreg = regs[concat->nchildren - 1];
     start = REG_START(state);
     end = REG_END(state);
-    rsqr = token_range(state->text, start, end);
+    rsqr = token_range(state, start, end);
 
     if (!square_match(lens, lsqr, rsqr)) {
         get_error(state, lens, "%s \"%s\" %s \"%s\"",
@@ -907,6 +1371,10 @@ static struct tree *get_square(struct lens *lens, struct state *state) {
  error:
     free_tree(tree);
     tree = NULL;
+    free_skel(state->skel);
+    free_dict(state->dict);
+    state->skel = NULL;
+    state->dict = NULL;
     goto done;
 }
 
@@ -1016,8 +1484,12 @@ static void get_terminal(struct frame *top, struct lens *lens,
     top->tree = get_lens(lens, state);
     top->key = state->key;
     top->value = state->value;
+    top->skel = state->skel;
+    top->dict = state->dict;
     state->key = NULL;
     state->value = NULL;
+    state->skel = NULL;
+    state->dict = NULL;
 }
 
 static void parse_terminal(struct frame *top, struct lens *lens,
@@ -1043,7 +1515,7 @@ static void visit_terminal(struct lens *lens, size_t start, size_t end,
         dbg_visit(lens, 'T', start, end, rec_state->fused, rec_state->lvl);
     match(state, lens, lens->ctype, end, start);
     struct frame *top = push_frame(rec_state, lens);
-    if (rec_state->mode == M_GET)
+    if (rec_state->mode & M_GET)
         get_terminal(top, lens, state);
     else
         parse_terminal(top, lens, state);
@@ -1077,12 +1549,14 @@ static void visit_enter(struct lens *lens,
         f->span = state->span;
         state->key = NULL;
         state->value = NULL;
-    } else if (lens->tag == L_MAYBE) {
-        push_frame(rec_state, lens);
-        if (state->info->flags & HERA_ENABLE_SPAN) {
-            state->span = make_span(state->info);
+        /* As in get_subtree, every node gets its own span */
+        if ((rec_state->mode & M_GET)
+            && (state->info->flags & HERA_ENABLE_SPAN)) {
+            state->span = get_make_span(state);
             ERR_NOMEM(state->span == NULL, state->info);
         }
+    } else if (lens->tag == L_MAYBE) {
+        push_frame(rec_state, lens);
     }
     child = ast_append(rec_state, lens, start, end);
     if (child != NULL)
@@ -1091,12 +1565,19 @@ static void visit_enter(struct lens *lens,
     return;
 }
 
-static void get_combine(struct rec_state *rec_state,
-                        struct lens *lens, uint n) {
+/* Replace the top N frames with one for LENS that combines their
+ * results */
+static void combine(struct rec_state *rec_state,
+                    struct lens *lens, uint n) {
     struct tree *tree = NULL, *tail = NULL;
+    struct skel *skel = NULL, *stail = NULL;
+    struct dict *dict = NULL;
     char *key = NULL, *value = NULL;
     struct frame *top = NULL;
 
+    if (rec_state->mode & M_PARSE)
+        skel = make_skel(lens);
+
     if (n > 0)
         top = top_frame(rec_state);
 
@@ -1106,6 +1587,14 @@ static void get_combine(struct rec_state *rec_state,
         if (tail != NULL)
             while (tail->next != NULL) tail = tail->next;
 
+        if (skel != NULL) {
+            list_tail_cons(skel->skels, stail, top->skel);
+            /* Same for top->skel */
+            if (stail != NULL)
+                while (stail->next != NULL) stail = stail->next;
+        }
+        dict_append(&dict, top->dict);
+
         if (top->key != NULL) {
             ensure(key == NULL, rec_state->state->info);
             key = top->key;
@@ -1117,37 +1606,10 @@ static void get_combine(struct rec_state *rec_state,
     }
     top = push_frame(rec_state, lens);
     top->tree = tree;
-    top->key = key;
-    top->value = value;
- error:
-    return;
-}
-
-static void parse_combine(struct rec_state *rec_state,
-                          struct lens *lens, uint n) {
-    struct skel *skel = make_skel(lens), *tail = NULL;
-    struct dict *dict = NULL;
-    char *key = NULL;
-    struct frame *top = NULL;
-
-    if (n > 0)
-        top = top_frame(rec_state);
-
-    for (int i=0; i < n; i++, top = pop_frame(rec_state)) {
-        list_tail_cons(skel->skels, tail, top->skel);
-        /* top->skel might have more than one node, update skel */
-        if (tail != NULL)
-            while (tail->next != NULL) tail = tail->next;
-        dict_append(&dict, top->dict);
-        if (top->key != NULL) {
-            ensure(key == NULL, rec_state->state->info);
-            key = top->key;
-        }
-    }
-    top = push_frame(rec_state, lens);
     top->skel = skel;
     top->dict = dict;
     top->key = key;
+    top->value = value;
  error:
     return;
 }
@@ -1170,35 +1632,44 @@ static void visit_exit(struct lens *lens,
 
     if (lens->tag == L_SUBTREE) {
         struct frame *top = top_frame(rec_state);
-        if (rec_state->mode == M_GET) {
-            struct tree *tree;
-            // FIXME: tree may leak if pop_frame ensure0 fail
-            tree = make_tree(top->key, top->value, NULL, top->tree);
-            tree->span = state->span;
-            ERR_NOMEM(tree == NULL, lens->info);
-            top = pop_frame(rec_state);
-            ensure(lens == top->lens, state->info);
-            state->key = top->key;
-            state->value = top->value;
-            state->span = top->span;
-            pop_frame(rec_state);
-            top = push_frame(rec_state, lens);
-            top->tree = tree;
-        } else {
-            struct skel *skel;
-            struct dict *dict;
+        struct tree *tree = NULL;
+        struct skel *skel = NULL;
+        struct dict *dict = NULL;
+        if (rec_state->mode & M_PARSE) {
+            char *key = top->key;
+            /* When we also build a tree, it gets the original key */
+            if ((rec_state->mode & M_GET) && key != NULL) {
+                key = strdup(key);
+                ERR_NOMEM(key == NULL, lens->info);
+            }
             skel = make_skel(lens);
             ERR_NOMEM(skel == NULL, lens->info);
-            dict = make_dict(top->key, top->skel, top->dict);
+            dict = make_dict(key, top->skel, top->dict);
             ERR_NOMEM(dict == NULL, lens->info);
-            top = pop_frame(rec_state);
-            ensure(lens == top->lens, state->info);
-            state->key = top->key;
-            pop_frame(rec_state);
-            top = push_frame(rec_state, lens);
-            top->skel = skel;
-            top->dict = dict;
+            top->skel = NULL;
+            top->dict = NULL;
+            if (! (rec_state->mode & M_GET))
+                top->key = NULL;
         }
+        if (rec_state->mode & M_GET) {
+            // FIXME: tree may leak if pop_frame ensure0 fail
+            tree = get_make_tree(state, top->key, top->value, top->tree);
+            ERR_NOMEM(tree == NULL, lens->info);
+            tree->span = state->span;
+        }
+        top = pop_frame(rec_state);
+        ensure(lens == top->lens, state->info);
+        state->key = top->key;
+        state->value = top->value;
+        if (state->span != NULL && state->span != top->span)
+            update_span(top->span, state->span->span_start,
+                        state->span->span_end);
+        state->span = top->span;
+        pop_frame(rec_state);
+        top = push_frame(rec_state, lens);
+        top->tree = tree;
+        top->skel = skel;
+        top->dict = dict;
     } else if (lens->tag == L_CONCAT) {
         ensure(rec_state->fused >= lens->nchildren, state->info);
         for (int i = 0; i < lens->nchildren; i++) {
@@ -1210,31 +1681,22 @@ static void visit_exit(struct lens *lens,
                     format_lens(lens->children[i]),
                     format_lens(fr->lens));
         }
-        if (rec_state->mode == M_GET)
-            get_combine(rec_state, lens, lens->nchildren);
-        else
-            parse_combine(rec_state, lens, lens->nchildren);
+        combine(rec_state, lens, lens->nchildren);
     } else if (lens->tag == L_STAR) {
         uint n = 0;
         while (n < rec_state->fused &&
                nth_frame(rec_state, n)->lens == lens->child)
             n++;
-        if (rec_state->mode == M_GET)
-            get_combine(rec_state, lens, n);
-        else
-            parse_combine(rec_state, lens, n);
+        combine(rec_state, lens, n);
     } else if (lens->tag == L_MAYBE) {
         uint n = 1;
         if (rec_state->fused > 0
             && top_frame(rec_state)->lens == lens->child) {
             n = 2;
         }
-        if (rec_state->mode == M_GET)
-            get_combine(rec_state, lens, n);
-        else
-            parse_combine(rec_state, lens, n);
+        combine(rec_state, lens, n);
     } else if (lens->tag == L_SQUARE) {
-        if (rec_state->mode == M_GET) {
+        if (rec_state->mode & M_GET) {
             struct ast *square, *concat, *right, *left;
             char *rsqr, *lsqr;
             int ret;
@@ -1243,8 +1705,8 @@ static void visit_exit(struct lens *lens,
             concat = child_first(square);
             right = child_first(concat);
             left = child_last(concat);
-            lsqr = token_range(state->text, left->start, left->end);
-            rsqr = token_range(state->text, right->start, right->end);
+            lsqr = token_range(state, left->start, left->end);
+            rsqr = token_range(state, right->start, right->end);
             ret = square_match(lens, lsqr, rsqr);
             if (! ret) {
                 get_error(state, lens, "%s \"%s\" %s \"%s\"",
@@ -1255,10 +1717,8 @@ static void visit_exit(struct lens *lens,
             FREE(rsqr);
             if (! ret)
                 goto error;
-            get_combine(rec_state, lens, 1);
-        } else {
-            parse_combine(rec_state, lens, 1);
         }
+        combine(rec_state, lens, 1);
     } else {
         top_frame(rec_state)->lens = lens;
     }
@@ -1285,6 +1745,7 @@ static struct frame *rec_process(enum mode_t mode, struct lens *lens,
     size_t len = 0;
     struct re_registers *old_regs = state->regs;
     uint old_nreg = state->nreg;
+    struct span *old_span = state->span;
     int r;
     struct jmt_visitor visitor;
     struct rec_state rec_state;
@@ -1310,7 +1771,8 @@ static struct frame *rec_process(enum mode_t mode, struct lens *lens,
     rec_state.ast = make_ast(lens);
     ERR_NOMEM(rec_state.ast == NULL, state->info);
 
-    visitor.parse = jmt_parse(lens->jmt, state->text + start, end - start);
+    visitor.parse = jmt_parse(lens->jmt, state->text + start, end - start,
+                              reaches_nl(state, start, end));
     ERR_BAIL(lens->info);
     visitor.terminal = visit_terminal;
     visitor.enter = visit_enter;
@@ -1340,21 +1802,29 @@ static struct frame *rec_process(enum mode_t mode, struct lens *lens,
         print_ast(ast_root(rec_state.ast), 0);
     state->regs = old_regs;
     state->nreg = old_nreg;
+    state->span = old_span;
     jmt_free_parse(visitor.parse);
     free_ast(ast_root(rec_state.ast));
     return rec_state.frames;
  error:
+    /* The spans of subtrees we did not get to the end of belong to no
+     * tree yet */
+    if (state->arena == NULL && state->span != old_span) {
+        free_span(state->span);
+        for (i = 0; i < rec_state.fused; i++) {
+            f = nth_frame(&rec_state, i);
+            if (f->span != old_span)
+                free_span(f->span);
+        }
+    }
 
     for(i = 0; i < rec_state.fused; i++) {
         f = nth_frame(&rec_state, i);
-        FREE(f->key);
-        if (mode == M_GET) {
-            FREE(f->value);
-            free_tree(f->tree);
-        } else if (mode == M_PARSE) {
-            free_skel(f->skel);
-            free_dict(f->dict);
-        }
+        tree_strfree(state, f->key);
+        tree_strfree(state, f->value);
+        free_tree(f->tree);
+        free_skel(f->skel);
+        free_dict(f->dict);
     }
     FREE(rec_state.frames);
     goto done;
@@ -1364,11 +1834,13 @@ static struct tree *get_rec(struct lens *lens, struct state *state) {
     struct frame *fr;
     struct tree *tree = NULL;
 
-    fr = rec_process(M_GET, lens, state);
+    fr = rec_process(state->parse ? M_GET|M_PARSE : M_GET, lens, state);
     if (fr != NULL) {
         tree = fr->tree;
         state->key = fr->key;
         state->value = fr->value;
+        state->skel = fr->skel;
+        state->dict = fr->dict;
         FREE(fr);
     }
     return tree;
@@ -1392,6 +1864,8 @@ static struct skel *parse_rec(struct lens *lens, struct state *state,
 static struct tree *get_lens(struct lens *lens, struct state *state) {
     struct tree *tree = NULL;
 
+    state->skel = NULL;
+    state->dict = NULL;
     switch(lens->tag) {
     case L_DEL:
         tree = get_del(lens, state);
@@ -1458,31 +1932,98 @@ static int init_regs(struct state *state, struct lens *lens, uint size) {
      * We can avoid matching the entire text in that case - that
      * match can be very expensive
      */
-    if (ALLOC(state->regs) < 0)
+    struct reg_set *set = take_regs(state);
+    if (set == NULL)
         return -1;
-    state->regs->num_regs = 1;
-    if (ALLOC(state->regs->start) < 0 || ALLOC(state->regs->end) < 0)
+    if (ALLOC(set->regs.start) < 0 || ALLOC(set->regs.end) < 0)
         return -1;
+    set->size = 1;
+    state->regs = &set->regs;
+    state->regs->num_regs = 1;
     state->regs->start[0] = 0;
     state->regs->end[0] = size;
     return 0;
 }
 
+/* Set up STATE to read TEXT of length LEN. If ADD_NEWLINE is set and TEXT
+ * does not end in a newline, the lens sees TEXT with a newline appended;
+ * this works around the fact that lenses generally break if the file does
+ * not end with a newline. TEXT itself is never modified or copied: the
+ * newline is only there in STATE->NL, and matches and tokens that reach
+ * the end of the text add it as they go.
+ *
+ * Return the size of the text as seen by the lens, or -1 on error.
+ */
+static int init_text(struct state *state, const char *text, size_t len,
+                     int add_newline) {
+    if (len >= INT_MAX)
+        return -1;
+    if (add_newline && (len == 0 || text[len-1] != '\n')) {
+        state->nl = true;
+        len += 1;
+    }
+    state->text = text;
+    state->text_len = len;
+    return len;
+}
+
 struct tree *lns_get(struct info *info, struct lens *lens, const char *text,
                      struct lns_error **err) {
+    return lns_get_n(info, lens, text, strlen(text), 0, err);
+}
+
+/* The guts of the LNS_GET_* functions. If EMIT is not NULL and LENS is
+ * a non-recursive L_STAR, the trees for its iterations are passed to EMIT
+ * instead of being returned; if EMIT has a BUILDER, the whole tree goes
+ * to it. If ARENA is not NULL, the tree is allocated
+ * from it, and if SLICES is not NULL as well, values are cut out of a
+ * copy of TEXT in ARENA, which *SLICES is set to */
+static struct tree *get_text(struct info *info, struct lens *lens,
+                             const char *text, size_t len, int add_newline,
+                             struct lns_parse **parse, struct emit *emit,
+                             struct tree_arena *arena, const char **slices,
+                             struct lns_error **err) {
     struct state state;
     struct tree *tree = NULL;
-    uint size = strlen(text);
+    struct tree_arena *scratch = NULL;
+    uint size;
     int partial, r;
 
     MEMZERO(&state, 1);
+    if (parse != NULL) {
+        *parse = NULL;
+        state.parse = true;
+    }
+    state.emit = emit;
+    state.arena = arena;
+    if (emit != NULL && emit->builder != NULL && lens->recursive) {
+        /* The parser for recursive lenses goes through the text back to
+         * front; build the tree in a scratch arena and replay it from
+         * there instead */
+        scratch = make_tree_arena();
+        ERR_NOMEM(scratch == NULL, info);
+        state.arena = scratch;
+        state.emit = NULL;
+    }
     r = ALLOC(state.info);
     ERR_NOMEM(r < 0, info);
 
     *state.info = *info;
     state.info->ref = UINT_MAX;
 
-    state.text = text;
+    r = init_text(&state, text, len, add_newline);
+    ERR_NOMEM(r < 0, info);
+    size = r;
+
+    if (slices != NULL) {
+        state.slices = tree_arena_alloc(arena, size + 1);
+        ERR_NOMEM(state.slices == NULL, info);
+        memcpy(state.slices, state.text, size - state.nl);
+        if (state.nl)
+            state.slices[size - 1] = '\n';
+        state.slices[size] = '\0';
+        *slices = state.slices;
+    }
 
     /* We are probably being overly cautious here: if the lens can't process
      * all of TEXT, we should really fail somewhere in one of the sublenses.
@@ -1494,6 +2035,8 @@ struct tree *lns_get(struct info *info, struct lens *lens, const char *text,
     if (partial >= 0) {
         if (lens->recursive)
             tree = get_rec(lens, &state);
+        else if (emit != NULL && emit->fn != NULL && lens->tag == L_STAR)
+            get_stream_star(lens, &state);
         else
             tree = get_lens(lens, &state);
     }
@@ -1501,19 +2044,40 @@ struct tree *lns_get(struct info *info, struct lens *lens, const char *text,
     free_seqs(state.seqs);
     if (state.key != NULL) {
         get_error(&state, lens, "get left unused key %s", state.key);
-        free(state.key);
+        tree_strfree(&state, state.key);
     }
     if (state.value != NULL) {
         get_error(&state, lens, "get left unused value %s", state.value);
-        free(state.value);
+        tree_strfree(&state, state.value);
     }
     if (partial && state.error == NULL) {
         get_error(&state, lens, "Get did not match entire input");
     }
 
+    if (parse != NULL && state.error == NULL) {
+        r = ALLOC(*parse);
+        ERR_NOMEM(r < 0, info);
+        (*parse)->lens = ref(lens);
+        (*parse)->skel = state.skel;
+        (*parse)->dict = state.dict;
+        state.skel = NULL;
+        state.dict = NULL;
+    }
+
+    if (scratch != NULL) {
+        if (state.error == NULL)
+            build_trees(emit, tree);
+        tree = NULL;
+    }
+
  error:
+    free_skel(state.skel);
+    free_dict(state.dict);
     free_regs(&state);
+    free_reg_pool(&state);
+    free(state.text_nl);
     FREE(state.info);
+    free_tree_arena(scratch);
 
     if (err != NULL) {
         *err = state.error;
@@ -1527,6 +2091,79 @@ struct tree *lns_get(struct info *info, struct lens *lens, const char *text,
     return tree;
 }
 
+struct tree *lns_get_n(struct info *info, struct lens *lens,
+                       const char *text, size_t len, int add_newline,
+                       struct lns_error **err) {
+    return get_text(info, lens, text, len, add_newline, NULL, NULL, NULL,
+                    NULL, err);
+}
+
+struct tree *lns_get_parse(struct info *info, struct lens *lens,
+                           const char *text, size_t len, int add_newline,
+                           struct lns_parse **parse, struct lns_error **err) {
+    return get_text(info, lens, text, len, add_newline, parse, NULL, NULL,
+                    NULL, err);
+}
+
+struct tree *lns_get_arena(struct info *info, struct lens *lens,
+                           const char *text, size_t len, int add_newline,
+                           struct tree_arena *arena, const char **slices,
+                           struct lns_error **err) {
+    return get_text(info, lens, text, len, add_newline, NULL, NULL, arena,
+                    slices, err);
+}
+
+int lns_get_stream(struct info *info, struct lens *lens,
+                   const char *text, size_t len, int add_newline,
+                   hera_emit_t fn, void *data, struct lns_error **err) {
+    struct emit emit;
+    struct lns_error *err1 = NULL;
+    struct tree *tree;
+
+    MEMZERO(&emit, 1);
+    emit.fn = fn;
+    emit.data = data;
+
+    /* For lenses other than (l)*, TREE is the whole tree */
+    tree = get_text(info, lens, text, len, add_newline, NULL, &emit, NULL,
+                    NULL, &err1);
+    if (err1 == NULL)
+        emit_trees(&emit, tree);
+    else
+        free_tree(tree);
+
+    if (err != NULL)
+        *err = err1;
+    else
+        free_lns_error(err1);
+    if (err1 != NULL)
+        return -1;
+    return emit.stopped ? 1 : 0;
+}
+
+int lns_get_build(struct info *info, struct lens *lens,
+                  const char *text, size_t len, int add_newline,
+                  const struct hera_builder *builder, void *data,
+                  struct lns_error **err) {
+    struct emit emit;
+    struct lns_error *err1 = NULL;
+
+    MEMZERO(&emit, 1);
+    emit.builder = builder;
+    emit.data = data;
+
+    get_text(info, lens, text, len, add_newline, NULL, &emit, NULL, NULL,
+             &err1);
+
+    if (err != NULL)
+        *err = err1;
+    else
+        free_lns_error(err1);
+    if (err1 != NULL)
+        return -1;
+    return emit.stopped ? 1 : 0;
+}
+
 static struct skel *parse_lens(struct lens *lens, struct state *state,
                                struct dict **dict) {
     struct skel *skel = NULL;
@@ -1581,9 +2218,15 @@ static struct skel *parse_lens(struct lens *lens, struct state *state,
 
 struct skel *lns_parse(struct lens *lens, const char *text, struct dict **dict,
                        struct lns_error **err) {
+    return lns_parse_n(lens, text, strlen(text), 0, dict, err);
+}
+
+struct skel *lns_parse_n(struct lens *lens, const char *text, size_t len,
+                         int add_newline, struct dict **dict,
+                         struct lns_error **err) {
     struct state state;
     struct skel *skel = NULL;
-    uint size = strlen(text);
+    uint size;
     int partial, r;
 
     MEMZERO(&state, 1);
@@ -1591,9 +2234,10 @@ struct skel *lns_parse(struct lens *lens, const char *text, struct dict **dict,
     ERR_NOMEM(r< 0, lens->info);
     state.info->ref = UINT_MAX;
     state.info->error = lens->info->error;
-    state.text = text;
 
-    state.text = text;
+    r = init_text(&state, text, len, add_newline);
+    ERR_NOMEM(r < 0, lens->info);
+    size = r;
 
     partial = init_regs(&state, lens, size);
     if (! partial) {
@@ -1625,6 +2269,8 @@ struct skel *lns_parse(struct lens *lens, const char *text, struct dict **dict,
 
  error:
     free_regs(&state);
+    free_reg_pool(&state);
+    free(state.text_nl);
     FREE(state.info);
     if (err != NULL) {
         *err = state.error;
@@ -0,0 +1,215 @@
+/*
+ * herabench.c: time hera_get_many over 1 to N threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/* Not built by default; 'make herabench' in src. It looks lenses up and
+ * frees trees with internal functions, and is therefore linked statically.
+ *
+ * Usage: herabench LENSDIR [MAXTHREADS [JOBS [REPEAT]]]
+ *
+ * Parses JOBS generated files for each of the Hosts, Fstab, Sudoers and
+ * Httpd lenses from LENSDIR, of sizes from a few lines to a few thousand,
+ * with 1 to MAXTHREADS threads, and prints the best of REPEAT runs for
+ * each. Httpd is recursive and goes through the Earley parser, the others
+ * do not.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heracles.h"
+#include "errcode.h"
+#include "internal.h"
+#include "memory.h"
+#include "syntax.h"
+#include "lens.h"
+
+typedef void (*gen_line_t)(FILE *out, size_t i);
+
+static void gen_hosts(FILE *out, size_t i) {
+    fprintf(out, "10.%zu.%zu.%zu\thost%zu.example.com host%zu\n",
+            (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, i, i);
+}
+
+static void gen_fstab(FILE *out, size_t i) {
+    fprintf(out, "/dev/vg0/lv%zu\t/srv/vol%zu\text4\tdefaults,noatime\t0 2\n",
+            i, i);
+}
+
+static void gen_sudoers(FILE *out, size_t i) {
+    if (i % 10 == 0)
+        fprintf(out, "# Rules for group %zu\n", i / 10);
+    else
+        fprintf(out, "user%zu ALL=(ALL) NOPASSWD: /usr/bin/tool%zu\n", i, i);
+}
+
+static void gen_httpd(FILE *out, size_t i) {
+    if (i % 8 == 0)
+        fprintf(out, "<VirtualHost *:%zu>\n  ServerName site%zu\n",
+                8000 + i, i);
+    else if (i % 8 == 7)
+        fprintf(out, "</VirtualHost>\n");
+    else
+        fprintf(out, "  Alias /a%zu /srv/www/a%zu\n", i, i);
+}
+
+static const struct {
+    const char *lens;
+    gen_line_t  gen;
+} kinds[] = {
+    { "Hosts.lns",   gen_hosts },
+    { "Fstab.lns",   gen_fstab },
+    { "Sudoers.lns", gen_sudoers },
+    { "Httpd.lns",   gen_httpd }
+};
+
+#define NKINDS (sizeof(kinds)/sizeof(kinds[0]))
+
+/* Sizes are spread the way they are under /etc: mostly small, a few
+ * large. Httpd files always close their last section */
+static char *gen_text(gen_line_t gen, size_t nlines, size_t *len) {
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+
+    if (out == NULL)
+        return NULL;
+    nlines = (nlines + 7) / 8 * 8;
+    for (size_t i = 0; i < nlines; i++)
+        gen(out, i);
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static size_t job_lines(size_t j) {
+    if (j % 16 == 15)
+        return 4000;
+    return 8 + 40 * (j % 8);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void release_results(struct hera_job *jobs, size_t njobs) {
+    for (size_t j = 0; j < njobs; j++) {
+        free_tree(jobs[j].tree);
+        free_lns_error(jobs[j].err);
+        jobs[j].tree = NULL;
+        jobs[j].err = NULL;
+    }
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s LENSDIR [MAXTHREADS [JOBS [REPEAT]]]\n",
+            progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    unsigned int maxthreads = 4, repeat = 3;
+    size_t jobs_per_kind = 64, njobs, bytes = 0;
+    struct hera_job *jobs = NULL;
+    heracles *hera;
+    double base = 0;
+
+    if (argc < 2 || argc > 5)
+        usage(argv[0]);
+    if (argc > 2)
+        maxthreads = strtoul(argv[2], NULL, 10);
+    if (argc > 3)
+        jobs_per_kind = strtoul(argv[3], NULL, 10);
+    if (argc > 4)
+        repeat = strtoul(argv[4], NULL, 10);
+    if (maxthreads == 0 || jobs_per_kind == 0 || repeat == 0)
+        usage(argv[0]);
+
+    hera = hera_init(argv[1], HERA_NO_STDINC);
+    if (hera == NULL || hera->error->code != HERA_NOERROR) {
+        fprintf(stderr, "herabench: could not load lenses from %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    njobs = NKINDS * jobs_per_kind;
+    if (ALLOC_N(jobs, njobs) < 0)
+        return EXIT_FAILURE;
+    for (size_t k = 0; k < NKINDS; k++) {
+        struct lens *lens = lens_lookup(hera, kinds[k].lens);
+        if (lens == NULL) {
+            fprintf(stderr, "herabench: no lens %s\n", kinds[k].lens);
+            return EXIT_FAILURE;
+        }
+        for (size_t j = 0; j < jobs_per_kind; j++) {
+            struct hera_job *job = jobs + k * jobs_per_kind + j;
+            job->lens = lens;
+            job->text = gen_text(kinds[k].gen, job_lines(j), &job->len);
+            if (job->text == NULL)
+                return EXIT_FAILURE;
+            bytes += job->len;
+        }
+    }
+
+    if (hera_freeze(hera) < 0) {
+        fprintf(stderr, "herabench: error %d\n", hera->error->code);
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu jobs, %.1f MB, %u online CPUs\n", njobs, bytes / 1e6,
+           (unsigned int) sysconf(_SC_NPROCESSORS_ONLN));
+    printf("threads  seconds  speedup     MB/s\n");
+    for (unsigned int n = 1; n <= maxthreads; n++) {
+        double best = 0;
+        for (unsigned int r = 0; r < repeat; r++) {
+            double start = now(), t;
+
+            if (hera_get_many(hera, jobs, njobs, n) < 0) {
+                fprintf(stderr, "herabench: error %d\n", hera->error->code);
+                return EXIT_FAILURE;
+            }
+            t = now() - start;
+            for (size_t j = 0; j < njobs; j++) {
+                if (jobs[j].tree == NULL) {
+                    fprintf(stderr, "herabench: job %zu (%s) did not parse\n",
+                            j, kinds[j / jobs_per_kind].lens);
+                    return EXIT_FAILURE;
+                }
+            }
+            release_results(jobs, njobs);
+            if (r == 0 || t < best)
+                best = t;
+        }
+        if (n == 1)
+            base = best;
+        printf("%7u  %7.3f  %7.2f  %7.1f\n", n, best, base / best,
+               bytes / 1e6 / best);
+    }
+
+    for (size_t j = 0; j < njobs; j++)
+        free((char *) jobs[j].text);
+    free(jobs);
+    hera_close(hera);
+    return EXIT_SUCCESS;
+}
@@ -27,6 +27,8 @@
 #include "syntax.h"
 #include "errcode.h"
 #include "tree.h"
+#include "pool.h"
+#include "transform.h"
 
 #include <fnmatch.h>
 #include <argz.h>
@@ -216,6 +218,8 @@ void hera_close(struct heracles *hera) {
         return;
 
     free_tree(hera->origin);
+    /* Thaws frozen lenses, so it has to come before freeing the modules */
+    interpreter_close(hera);
     unref(hera->modules, module);
     if (hera->error->exn != NULL) {
         hera->error->exn->ref = 0;
@@ -238,47 +242,443 @@ void hera_close(struct heracles *hera) {
 /***********************************************************************
  *                       Heracles added stuff                          *
  ***********************************************************************/
-static char *append_newline(char *text, size_t len) {
-    /* Try to append a newline; this is a big hack to work */
-    /* around the fact that lenses generally break if the  */
-    /* file does not end with a newline. */
-    if (len == 0 || text[len-1] != '\n') {
-        if (REALLOC_N(text, len+2) == 0) {
-            text[len] = '\n';
-            text[len+1] = '\0';
-        }
-    }
-    return text;
-}
-
-struct tree * hera_get(struct lens *lens, char *text, struct lns_error *err) {
-    struct tree *tree = NULL;
+/* Where the text for a get comes from */
+static struct info *text_info(const char *filename) {
     struct info *info;
     make_ref(info);
     info->flags = 0;
     info->first_line = 1;
     info->filename = NULL;
+    if (filename != NULL)
+        info->filename = dup_string(filename);
+    return info;
+}
 
-    int text_len = strlen(text);
-    text = append_newline(text, text_len);
+static struct tree *get_text(struct lens *lens, const char *filename,
+                             const char *text, size_t len,
+                             struct lns_parse **parse,
+                             struct lns_error **err) {
+    struct tree *tree = NULL;
+    struct info *info = text_info(filename);
 
-    tree = lns_get(info, lens, text, &err);
+    /* Lenses generally break if the text does not end with a newline;
+     * have the parser supply one if it is missing */
+    tree = lns_get_parse(info, lens, text, len, 1, parse, err);
 
     unref(info, info);
 
     return tree;
 }
 
-char * hera_put(struct lens *lens, struct tree *tree, char *text, struct lns_error *err)
-{
+static int get_stream(struct lens *lens, const char *filename,
+                      const char *text, size_t len,
+                      hera_emit_t emit, void *data, struct lns_error **err) {
+    struct info *info = text_info(filename);
+    int r;
+
+    /* Supply a missing final newline, as in get_text */
+    r = lns_get_stream(info, lens, text, len, 1, emit, data, err);
+
+    unref(info, info);
+
+    return r;
+}
+
+int hera_freeze(struct heracles *hera) {
+    return interpreter_freeze(hera);
+}
+
+/* Set *ERR, if ERR is not NULL, to an error about a failed system call
+ * with errno still set */
+static void io_error(struct lens *lens, struct lns_error **err,
+                     const char *what, const char *path) {
+    char ebuf[128];
+    const char *msg = xstrerror(errno, ebuf, sizeof(ebuf));
+
+    if (err == NULL)
+        return;
+    CALLOC(*err, 1);
+    if (*err != NULL) {
+        (*err)->lens = ref(lens);
+        if (path == NULL)
+            xasprintf(&(*err)->message, "%s: %s", what, msg);
+        else
+            xasprintf(&(*err)->message, "%s %s: %s", what, path, msg);
+    }
+}
+
+struct tree *hera_get_n(struct lens *lens, const char *text, size_t len,
+                       struct lns_error **err) {
+    return get_text(lens, NULL, text, len, NULL, err);
+}
+
+struct tree *hera_get_parse(struct lens *lens, const char *text, size_t len,
+                            struct lns_parse **parse,
+                            struct lns_error **err) {
+    return get_text(lens, NULL, text, len, parse, err);
+}
+
+struct tree *hera_get_spans(struct lens *lens, const char *text, size_t len,
+                            struct lns_parse **parse,
+                            struct lns_error **err) {
+    struct tree *tree = NULL;
+    struct info *info = text_info(NULL);
+
+    info->flags = HERA_ENABLE_SPAN;
+    /* Supply a missing final newline, as in get_text */
+    tree = lns_get_parse(info, lens, text, len, 1, parse, err);
+
+    unref(info, info);
+
+    /* Nodes start out dirty; from here on, only changes make them so */
+    list_for_each(t, tree)
+        tree_clean(t);
+    return tree;
+}
+
+struct tree *hera_get_file(struct lens *lens, const char *path,
+                           struct lns_error **err) {
+    struct file_map fm;
+    struct tree *tree = NULL;
+
+    if (map_file(path, &fm) < 0) {
+        io_error(lens, err, "Can not read", path);
+        return NULL;
+    }
+
+    tree = get_text(lens, path, fm.text, fm.len, NULL, err);
+
+    unmap_file(&fm);
+    return tree;
+}
+
+struct tree_arena *hera_arena_new(void) {
+    return make_tree_arena();
+}
+
+void hera_arena_free(struct tree_arena *arena) {
+    free_tree_arena(arena);
+}
+
+struct tree *hera_get_arena(struct lens *lens, const char *text, size_t len,
+                            struct tree_arena *arena,
+                            struct lns_error **err) {
+    struct tree *tree = NULL;
+    struct info *info = text_info(NULL);
+
+    /* Supply a missing final newline, as in get_text */
+    tree = lns_get_arena(info, lens, text, len, 1, arena, NULL, err);
+
+    unref(info, info);
+
+    return tree;
+}
+
+struct tree *hera_get_slices(struct lens *lens, const char *text, size_t len,
+                             struct tree_arena *arena, const char **base,
+                             struct lns_error **err) {
+    struct tree *tree = NULL;
+    struct info *info = text_info(NULL);
+
+    *base = NULL;
+    tree = lns_get_arena(info, lens, text, len, 1, arena, base, err);
+
+    unref(info, info);
+
+    return tree;
+}
+
+struct hera_flat *hera_get_flat(struct lens *lens, const char *text,
+                                size_t len, struct lns_error **err) {
+    struct tree_arena *arena = NULL;
+    struct hera_flat *flat = NULL;
+    struct lns_error *error = NULL;
+    struct info *info = NULL;
+    struct tree *tree;
+
+    if (err != NULL)
+        *err = NULL;
+
+    /* The tree only lives until it is flattened; building it in an arena
+     * makes it cheap to throw away, and interns its labels for
+     * TREE_FLATTEN */
+    arena = make_tree_arena();
+    if (arena == NULL)
+        goto nomem;
+    info = text_info(NULL);
+    tree = lns_get_arena(info, lens, text, len, 1, arena, NULL, &error);
+    unref(info, info);
+    if (error != NULL) {
+        if (err != NULL)
+            *err = error;
+        else
+            free_lns_error(error);
+        free_tree_arena(arena);
+        return NULL;
+    }
+
+    flat = tree_flatten(tree);
+    free_tree_arena(arena);
+    if (flat == NULL)
+        goto nomem;
+    return flat;
+
+ nomem:
+    errno = ENOMEM;
+    io_error(lens, err, "Can not flatten tree", NULL);
+    return NULL;
+}
+
+void hera_free_flat(struct hera_flat *flat) {
+    free_hera_flat(flat);
+}
+
+int hera_get_build(struct lens *lens, const char *text, size_t len,
+                   const struct hera_builder *builder, void *data,
+                   struct lns_error **err) {
+    struct info *info = text_info(NULL);
+    int r;
+
+    /* Supply a missing final newline, as in get_text */
+    r = lns_get_build(info, lens, text, len, 1, builder, data, err);
+
+    unref(info, info);
+
+    return r;
+}
+
+int hera_get_stream(struct lens *lens, const char *text, size_t len,
+                    hera_emit_t emit, void *data, struct lns_error **err) {
+    return get_stream(lens, NULL, text, len, emit, data, err);
+}
+
+int hera_get_file_stream(struct lens *lens, const char *path,
+                         hera_emit_t emit, void *data,
+                         struct lns_error **err) {
+    struct file_map fm;
+    int r;
+
+    if (map_file(path, &fm) < 0) {
+        io_error(lens, err, "Can not read", path);
+        return -1;
+    }
+
+    r = get_stream(lens, path, fm.text, fm.len, emit, data, err);
+
+    unmap_file(&fm);
+    return r;
+}
+
+static void get_job(void *data, size_t i) {
+    struct hera_job *job = (struct hera_job *) data + i;
+
+    job->err = NULL;
+    job->tree = get_text(job->lens, NULL, job->text, job->len, NULL,
+                         &job->err);
+}
+
+int hera_get_many(struct heracles *hera, struct hera_job *jobs,
+                  size_t njobs, unsigned int nthreads) {
+    size_t *cost = NULL;
+
+    /* Running the jobs concurrently is only safe on a frozen instance;
+     * freezing it here would stop it from loading modules behind the
+     * caller's back */
+    if (hera->frozen == NULL) {
+        report_error(hera->error, HERA_EBADARG,
+                     "hera_get_many needs an instance frozen with hera_freeze");
+        return -1;
+    }
+
+    /* Without cost estimates, jobs are still run, just not biggest
+     * first */
+    if (ALLOC_N(cost, njobs) == 0) {
+        for (size_t i=0; i < njobs; i++)
+            cost[i] = jobs[i].len;
+    }
+    pool_run(njobs, cost, nthreads, get_job, jobs);
+    free(cost);
+    return 0;
+}
+
+static int detected_cmp(const void *p1, const void *p2) {
+    const struct hera_detected *d1 = p1, *d2 = p2;
+
+    if (d1->complete != d2->complete)
+        return d2->complete - d1->complete;
+    if (d1->consumed != d2->consumed)
+        return d1->consumed < d2->consumed ? 1 : -1;
+    if (d1->autoload != d2->autoload)
+        return d2->autoload - d1->autoload;
+    return strcmp(d1->module, d2->module);
+}
+
+int hera_detect(struct heracles *hera, const char *text, size_t len,
+                const char *path, struct hera_detected **found) {
+    struct hera_detected *det = NULL;
+    size_t ndet = 0, size = 0;
+    /* Supply a missing final newline, as in get_text */
+    const char *tail = (len == 0 || text[len-1] != '\n') ? "\n" : "";
+    size_t tail_len = strlen(tail);
+    /* TEXT and TAIL in one string, for lenses the DFA can't check; made
+     * the first time one of them comes up */
+    char *joined = NULL;
+
+    list_for_each(module, hera->modules) {
+        struct lens *lens = NULL;
+        size_t count;
+        int r;
+
+        list_for_each(b, module->bindings) {
+            if (STREQ(b->ident->str, "lns")
+                && b->value != NULL && b->value->tag == V_LENS) {
+                lens = b->value->lens;
+                break;
+            }
+        }
+        if (lens == NULL || lens->recursive)
+            continue;
+
+        r = regexp_prefix(lens->ctype, text, len, tail, &count);
+        if (r == -3) {
+            if (joined == NULL) {
+                if (len + tail_len > INT_MAX
+                    || ALLOC_N(joined, len + tail_len) < 0)
+                    goto error;
+                memcpy(joined, text, len);
+                memcpy(joined + len, tail, tail_len);
+            }
+            r = regexp_match(lens->ctype, joined, len + tail_len, 0, NULL);
+            if (r >= 0) {
+                count = r;
+                r = 0;
+            }
+        }
+        if (r < -1)
+            goto error;
+        if (r == -1 || count == 0)
+            continue;
+        if (ndet == size) {
+            size = size == 0 ? 8 : 2 * size;
+            if (REALLOC_N(det, size) < 0)
+                goto error;
+        }
+        det[ndet].module = module->name;
+        det[ndet].lens = lens;
+        det[ndet].complete = (count == len + tail_len);
+        /* Do not count the final newline we supplied */
+        det[ndet].consumed = count < len ? count : len;
+        det[ndet].autoload = path != NULL && module->autoload != NULL
+            && filter_matches(module->autoload->filter, path);
+        ndet += 1;
+    }
+    free(joined);
+    if (ndet > 0)
+        qsort(det, ndet, sizeof(*det), detected_cmp);
+    *found = det;
+    return ndet;
+ error:
+    free(joined);
+    free(det);
+    *found = NULL;
+    return -1;
+}
+
+struct tree * hera_get(struct lens *lens, char *text, struct lns_error *err) {
+    return hera_get_n(lens, text, strlen(text), &err);
+}
+
+char *hera_put_n(struct lens *lens, struct tree *tree,
+                 const char *text, size_t len, struct lns_error **err) {
+    struct memstream ms;
+
+    init_memstream(&ms);
+    lns_put_n(ms.stream, lens, tree, text, len, 1, err);
+    close_memstream(&ms);
+    return ms.buf;
+}
+
+char *hera_put_parse(struct lens *lens, struct tree *tree,
+                     struct lns_parse *parse, struct lns_error **err) {
     struct memstream ms;
 
     init_memstream(&ms);
-    lns_put(ms.stream, lens, tree, text, &err);
+    lns_put_parse(ms.stream, lens, tree, parse, err);
     close_memstream(&ms);
     return ms.buf;
 }
 
+char *hera_put_spans(struct lens *lens, struct tree *tree,
+                     const char *text, size_t len, struct lns_parse *parse,
+                     struct lns_error **err) {
+    struct memstream ms;
+
+    init_memstream(&ms);
+    lns_put_spans(ms.stream, lens, tree, text, len, 1, parse, err);
+    close_memstream(&ms);
+    return ms.buf;
+}
+
+void hera_free_parse(struct lns_parse *parse) {
+    free_lns_parse(parse);
+}
+
+int hera_put_cb(struct lens *lens, struct tree *tree,
+                const char *text, size_t len,
+                hera_write_t write, void *data, struct lns_error **err) {
+    struct writestream ws;
+    struct lns_error *err1 = NULL;
+    int r;
+
+    if (err != NULL)
+        *err = NULL;
+
+    if (init_writestream(&ws, write, data) < 0) {
+        io_error(lens, err, "Can not set up output stream", NULL);
+        return -1;
+    }
+    lns_put_n(ws.stream, lens, tree, text, len, 1, &err1);
+    r = close_writestream(&ws);
+
+    if (err1 != NULL) {
+        if (err != NULL)
+            *err = err1;
+        else
+            free_lns_error(err1);
+        return -1;
+    }
+    if (r < 0) {
+        io_error(lens, err, "Can not write output", NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t fd_write(void *data, const char *buf, size_t len) {
+    int fd = *(int *) data;
+    ssize_t n;
+
+    do {
+        n = write(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+int hera_put_fd(struct lens *lens, struct tree *tree,
+                const char *text, size_t len, int fd,
+                struct lns_error **err) {
+    return hera_put_cb(lens, tree, text, len, fd_write, &fd, err);
+}
+
+const char *hera_lns_error_message(struct lns_error *err) {
+    return lns_error_message(err);
+}
+
+char * hera_put(struct lens *lens, struct tree *tree, char *text, struct lns_error *err)
+{
+    return hera_put_n(lens, tree, text, strlen(text), &err);
+}
+
 struct pathx *pathx_hera_parse(const struct heracles *hera,
                               struct tree *tree,
                               struct tree *root_ctx,
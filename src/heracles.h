@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #ifndef HERACLES_H_
 #define HERACLES_H_
@@ -28,6 +29,8 @@
 typedef struct heracles heracles;
 struct lens;
 struct lns_error;
+struct lns_parse;
+struct tree_arena;
 struct error;
 struct tree;
 
@@ -55,7 +58,13 @@ enum hera_flags {
     HERA_ENABLE_SPAN  = (1 << 7),  /* Track the span in the input of nodes */
     HERA_NO_ERR_CLOSE = (1 << 8),  /* Do not close automatically when
                                      encountering error during hera_init */
-    HERA_TRACE_MODULE_LOADING = (1 << 9) /* For use by heraparse -t */
+    HERA_TRACE_MODULE_LOADING = (1 << 9), /* For use by heraparse -t */
+    HERA_LAZY_LOAD    = (1 << 10)  /* Only index the modules on the load
+                                     path in HERA_INIT; each module is
+                                     compiled the first time it is looked
+                                     up. The index is not updated when
+                                     files are added to the load path
+                                     later */
 };
 
 #ifdef __cplusplus
@@ -74,18 +83,381 @@ heracles *hera_init(const char *loadpath, unsigned int flags);
 
 void hera_close(heracles *hera);
 
+/*
+ *  hera_freeze : Prepares all modules loaded into HERA for use from several
+ *  threads at once. Every regexp is compiled, and every recursive lens
+ *  gets its parser tables, right away rather than on first use. Reference
+ *  counts are not changed by hera_get or hera_put afterwards.
+ *
+ *  Once it returns 0, lenses from HERA can be passed to the hera_get and
+ *  hera_put functions from any number of threads concurrently, as can
+ *  lens_lookup for modules that are already loaded. No more modules are
+ *  loaded, so with HERA_LAZY_LOAD, look up everything you need first.
+ *  Errors returned by hera_get and hera_put must be freed before
+ *  hera_close.
+ *
+ *  Compiling a regexp briefly sets re_syntax_options, the process-wide
+ *  syntax of the regex library, and restores it afterwards. Heracles
+ *  never does that from two threads at once, but other code in the
+ *  process that compiles patterns with re_compile_pattern, or reads
+ *  re_syntax_options, must not run while HERA compiles: during hera_init,
+ *  module loading and hera_freeze. After hera_freeze, the regexps of the
+ *  loaded modules are never compiled again.
+ *
+ *  Returns -1 on error, and 0 on success
+ */
+
+int hera_freeze(heracles *hera);
+
 /*
  *  hera_get : Parses text with lens
  */
 
 struct tree * hera_get(struct lens *lens, char *text, struct lns_error *err);
 
+/*
+ *  hera_get_n : Parses the LEN bytes at TEXT with lens. TEXT does not need
+ *  to be NUL-terminated and is never modified, so it can point into
+ *  read-only or mmap'd memory
+ */
+
+struct tree *hera_get_n(struct lens *lens, const char *text, size_t len,
+                        struct lns_error **err);
+
+/*
+ *  hera_get_file : Parses the file PATH with lens. Files of 64 KiB or more
+ *  are mapped into memory read-only instead of being read into a buffer.
+ *  Such a file must not be truncated while it is parsed: reading the
+ *  part of the mapping past its new end kills the process with SIGBUS.
+ *  Files that others rewrite in place should be read with hera_get_n
+ *  instead
+ */
+
+struct tree *hera_get_file(struct lens *lens, const char *path,
+                           struct lns_error **err);
+
+/*
+ *  hera_get_parse : Like hera_get_n, but if PARSE is not NULL, also keeps
+ *  what hera_put needs to know about the formatting of TEXT. It is built
+ *  in the same pass over TEXT as the tree, so that a later
+ *  hera_put_parse does not have to parse TEXT again.
+ *
+ *  *PARSE is set to NULL if TEXT did not parse. Otherwise, the caller
+ *  must pass it to hera_put_parse or hera_free_parse. It does not refer
+ *  to TEXT, which can be freed or changed once this returns.
+ */
+
+struct tree *hera_get_parse(struct lens *lens, const char *text, size_t len,
+                            struct lns_parse **parse,
+                            struct lns_error **err);
+
+/*
+ *  hera_arena_new : Creates an arena for hera_get_arena. Returns NULL if
+ *  there is not enough memory
+ */
+
+struct tree_arena *hera_arena_new(void);
+
+/*
+ *  hera_arena_free : Releases ARENA and, in one go, every tree node and
+ *  string allocated from it. Nodes that were added to such a tree and
+ *  values that were changed with the tree functions are released, too;
+ *  subtrees grafted in from elsewhere are not
+ */
+
+void hera_arena_free(struct tree_arena *arena);
+
+/*
+ *  hera_get_spans : Like hera_get_parse, but also records for each node
+ *  where in TEXT it came from, and returns a tree with all its nodes
+ *  marked clean. Changing the tree with tree_set_value, tree_append,
+ *  tree_unlink and the like marks the nodes that change, and their
+ *  ancestors, dirty. PARSE can be NULL.
+ */
+
+struct tree *hera_get_spans(struct lens *lens, const char *text, size_t len,
+                            struct lns_parse **parse,
+                            struct lns_error **err);
+
+/*
+ *  hera_get_arena : Like hera_get_n, but the nodes of the tree and their
+ *  labels, values and spans are allocated from ARENA. That is much
+ *  cheaper than allocating them one by one, and the whole tree is freed
+ *  with hera_arena_free instead of free_tree, which can still be used on
+ *  it but does not free anything. An arena can hold any number of trees,
+ *  which all stay valid until it is freed.
+ *
+ *  Labels are kept only once per arena: all nodes in ARENA with the same
+ *  label share one copy of it, whichever tree they belong to.
+ */
+
+struct tree *hera_get_arena(struct lens *lens, const char *text, size_t len,
+                            struct tree_arena *arena,
+                            struct lns_error **err);
+
+/*
+ *  hera_get_slices : Like hera_get_arena, but ARENA also keeps a copy of
+ *  TEXT, and *BASE is set to it. The values of the tree are, as far as
+ *  possible, not copied one by one but point into that copy, which has a
+ *  NUL written after each of them in place of the character that
+ *  followed.
+ *
+ *  A value V with BASE <= V <= BASE + LEN is the part of TEXT that
+ *  starts at offset V - BASE and is strlen(V) bytes long; bindings can
+ *  use that to hand values out as slices of TEXT without allocating
+ *  anything per node. Values that could not be cut out of the copy, and
+ *  values changed later, are separate strings as with hera_get_arena.
+ */
+
+struct tree *hera_get_slices(struct lens *lens, const char *text, size_t len,
+                             struct tree_arena *arena, const char **base,
+                             struct lns_error **err);
+
+/*
+ *  hera_get_flat : Like hera_get_n, but returns the tree as two arrays
+ *  rather than as linked nodes, so that it can be handed to a language
+ *  binding in one piece.
+ *
+ *  NODES lists the nodes of the tree in document order, every node before
+ *  its children. Nodes refer to each other by their index in NODES, and
+ *  to their label and value by their offset in STRINGS, where they are
+ *  NUL-terminated; -1 stands for a missing node or string. Nodes with the
+ *  same label share one copy of it.
+ *
+ *  Returns NULL if TEXT does not parse, with ERR, if not NULL, set to
+ *  explain why, and otherwise a result that must be freed with
+ *  hera_free_flat. A text that parses to an empty tree has no nodes.
+ */
+
+struct hera_flat_node {
+    int     parent;         /* -1 for toplevel nodes */
+    int     first_child;
+    int     next;           /* The next sibling */
+    int     label;
+    int     label_len;
+    int     value;
+    int     value_len;
+};
+
+struct hera_flat {
+    size_t                  nnodes;
+    struct hera_flat_node  *nodes;
+    size_t                  size;      /* Bytes in STRINGS */
+    char                   *strings;
+};
+
+struct hera_flat *hera_get_flat(struct lens *lens, const char *text,
+                                size_t len, struct lns_error **err);
+
+/*
+ *  hera_free_flat : Frees the result of hera_get_flat
+ */
+
+void hera_free_flat(struct hera_flat *flat);
+
+/*
+ *  hera_emit_t : Receives one toplevel node of the tree built by
+ *  hera_get_stream, together with its subtree, and owns it from then on.
+ *  Returns 0 to go on, anything else to stop
+ */
+
+typedef int (*hera_emit_t)(void *data, struct tree *tree);
+
+/*
+ *  hera_get_stream : Like hera_get_n, but instead of returning the tree,
+ *  passes its toplevel nodes one at a time to EMIT, with DATA as its first
+ *  argument. For lenses of the usual form (l)*, every node is passed on
+ *  as soon as it is parsed, so that memory use is bounded by the size of
+ *  the largest record rather than that of the whole text.
+ *
+ *  Returns -1 if TEXT does not parse, with ERR, if not NULL, set to
+ *  explain why; the nodes EMIT got before that remain its own. Returns 1
+ *  if EMIT asked to stop, and 0 otherwise.
+ */
+
+int hera_get_stream(struct lens *lens, const char *text, size_t len,
+                    hera_emit_t emit, void *data, struct lns_error **err);
+
+/*
+ *  hera_get_file_stream : Like hera_get_stream for the file PATH, which is
+ *  mapped into memory as in hera_get_file. The file must not be truncated
+ *  until it returns, for the same reason
+ */
+
+int hera_get_file_stream(struct lens *lens, const char *path,
+                         hera_emit_t emit, void *data,
+                         struct lns_error **err);
+
+/*
+ *  hera_builder : Callbacks through which hera_get_build hands over the
+ *  tree it parses, one node at a time. Each gets the DATA passed to
+ *  hera_get_build as its first argument, and returns 0 to go on and
+ *  anything else to stop. All four must be set.
+ *
+ *  Every node starts with a call to BEGIN_SUBTREE. Then come its
+ *  children, each with calls of its own, and then SET_LABEL and
+ *  SET_VALUE, if the node has a label or value, and finally END_SUBTREE.
+ *  Nodes are passed on in the order in which they appear in the text. The
+ *  strings passed to SET_LABEL and SET_VALUE are only valid during the
+ *  call.
+ */
+
+struct hera_builder {
+    int (*begin_subtree)(void *data);
+    int (*set_label)(void *data, const char *label);
+    int (*set_value)(void *data, const char *value);
+    int (*end_subtree)(void *data);
+};
+
+/*
+ *  hera_get_build : Like hera_get_n, but instead of building a tree, tells
+ *  BUILDER about each of its nodes, so that a caller that needs the tree
+ *  in a form of its own does not have to build it twice.
+ *
+ *  Returns -1 if TEXT does not parse, with ERR, if not NULL, set to
+ *  explain why; BUILDER may have been told about part of the tree by
+ *  then. Returns 1 if BUILDER asked to stop, and 0 otherwise.
+ */
+
+int hera_get_build(struct lens *lens, const char *text, size_t len,
+                   const struct hera_builder *builder, void *data,
+                   struct lns_error **err);
+
+/*
+ *  hera_get_many : Parses the text of each of the NJOBS JOBS with its lens,
+ *  like hera_get_n does, using NTHREADS threads; 0 means one thread per
+ *  online CPU. The lenses must all come from HERA, which must have been
+ *  frozen with hera_freeze beforehand.
+ *
+ *  Returns -1 if HERA is not frozen, in which case no job has been run
+ *  and the error of HERA is set to HERA_EBADARG, and 0 otherwise. The
+ *  result of each job is in its TREE and ERR, which the caller must free.
+ */
+
+struct hera_job {
+    struct lens      *lens;
+    const char       *text;     /* LEN bytes, need not be NUL-terminated */
+    size_t            len;
+    struct tree      *tree;     /* The parsed tree */
+    struct lns_error *err;      /* NULL, or why the text did not parse */
+};
+
+int hera_get_many(heracles *hera, struct hera_job *jobs, size_t njobs,
+                  unsigned int nthreads);
+
+/*
+ *  hera_detect : Finds the modules loaded into HERA whose lens lns fits the
+ *  LEN bytes at TEXT. Rather than parsing TEXT, this only runs the type of
+ *  each lens over it, which builds neither trees nor submatches, to see how
+ *  much of TEXT the lens would get through; when a type accepts all of it,
+ *  the text usually, though not always, parses.
+ *
+ *  The lenses that get through any of TEXT are stored in a new array in
+ *  *FOUND, which the caller must free, best fit first: those that take all
+ *  of TEXT, then by how much of it they take. Text alone often fits many
+ *  lenses equally well, since most lenses accept comments and lines of
+ *  words; if PATH is not NULL, ties go to modules whose autoload transform
+ *  includes the file PATH. Recursive lenses have no such type and are never
+ *  found, and with HERA_LAZY_LOAD, only modules that have been loaded
+ *  already are tried. The automaton for each type is built on the first
+ *  call, which is therefore much slower than later ones.
+ *
+ *  Returns the number of lenses in *FOUND, and -1 on error
+ */
+
+struct hera_detected {
+    const char   *module;       /* Name of the module, owned by HERA */
+    struct lens  *lens;         /* Its lns */
+    size_t        consumed;     /* Bytes at the start of TEXT it takes */
+    int           complete;     /* 1 if it takes all of TEXT */
+    int           autoload;     /* 1 if the module would load PATH */
+};
+
+int hera_detect(heracles *hera, const char *text, size_t len,
+                const char *path, struct hera_detected **found);
+
 /*
  *  hera_put : Dumps parsed tree to text
  */
 
 char * hera_put(struct lens *lens, struct tree *tree, char *text, struct lns_error *err);
 
+/*
+ *  hera_put_n : Like hera_put, with the original TEXT given as in hera_get_n
+ */
+
+char *hera_put_n(struct lens *lens, struct tree *tree,
+                 const char *text, size_t len, struct lns_error **err);
+
+/*
+ *  hera_put_parse : Like hera_put_n, for the original text that PARSE was
+ *  made from by hera_get_parse with the same LENS. PARSE can only be used
+ *  for one put, and is freed by it
+ */
+
+char *hera_put_parse(struct lens *lens, struct tree *tree,
+                     struct lns_parse *parse, struct lns_error **err);
+
+/*
+ *  hera_put_spans : Like hera_put_n, for a TREE from hera_get_spans on the
+ *  same TEXT. Subtrees that are still clean are copied from TEXT as they
+ *  are instead of being put through LENS, so that the work mostly depends
+ *  on how much of the tree changed. PARSE is NULL or the parse that
+ *  hera_get_spans made along with TREE, and is then used up as in
+ *  hera_put_parse, so that TEXT is not parsed again either.
+ */
+
+char *hera_put_spans(struct lens *lens, struct tree *tree,
+                     const char *text, size_t len, struct lns_parse *parse,
+                     struct lns_error **err);
+
+/*
+ *  hera_free_parse : Frees a PARSE from hera_get_parse that is not passed
+ *  to hera_put_parse
+ */
+
+void hera_free_parse(struct lns_parse *parse);
+
+/*
+ *  hera_write_t : Writes LEN bytes from BUF for hera_put_cb. Returns how
+ *  many bytes were written, or -1 with errno set on error. Fewer than LEN
+ *  bytes can be written; the function is then called again for the rest
+ */
+
+typedef ssize_t (*hera_write_t)(void *data, const char *buf, size_t len);
+
+/*
+ *  hera_put_cb : Like hera_put_n, but the output is passed to WRITE, with
+ *  DATA as its first argument, as it is produced instead of being
+ *  returned as one string. Only a small buffer is held in memory.
+ *
+ *  Returns 0 on success and -1 on error. ERR, if not NULL, is then set to
+ *  explain what went wrong. Part of the output may already have been
+ *  written when an error happens.
+ */
+
+int hera_put_cb(struct lens *lens, struct tree *tree,
+                const char *text, size_t len,
+                hera_write_t write, void *data, struct lns_error **err);
+
+/*
+ *  hera_put_fd : Like hera_put_cb, writing the output to file descriptor FD
+ */
+
+int hera_put_fd(struct lens *lens, struct tree *tree,
+                const char *text, size_t len, int fd,
+                struct lns_error **err);
+
+/*
+ *  hera_lns_error_message : Returns the message of ERR, an error from one
+ *  of the get or put functions. Since messages can contain whole regular
+ *  expressions and trees, they are only put together when they are first
+ *  asked for. The message belongs to ERR. Returns NULL if we run out of
+ *  memory.
+ */
+
+const char *hera_lns_error_message(struct lns_error *err);
+
 /*
  *  reset_error : Resets heracles error after exception
  */
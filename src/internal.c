@@ -26,6 +26,12 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <locale.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "internal.h"
 #include "memory.h"
@@ -157,6 +163,98 @@ char* xread_file(const char *path) {
     return result;
 }
 
+#if HAVE_MMAP
+/* Files smaller than this are read into a buffer rather than mapped. For
+ * them, a copy costs little more than setting up the mapping, and it can't
+ * fault if the file is truncated while the caller still uses it */
+#define MAP_FILE_MIN_LEN (64 * 1024)
+
+/* Read the FM->LEN bytes of the file open on FD into a buffer. If the
+ * file got shorter since we looked at its size, FM->LEN is set to what
+ * could still be read */
+static int read_fd(int fd, struct file_map *fm) {
+    char *buf;
+    size_t n = 0;
+
+    if (ALLOC_N(buf, fm->len + 1) < 0)
+        return -1;
+    while (n < fm->len) {
+        ssize_t r = read(fd, buf + n, fm->len - n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            free(buf);
+            return -1;
+        }
+        if (r == 0)
+            break;
+        n += r;
+    }
+    fm->text = buf;
+    fm->len = n;
+    return 0;
+}
+#endif
+
+int map_file(const char *path, struct file_map *fm) {
+    MEMZERO(fm, 1);
+#if HAVE_MMAP
+    struct stat st;
+    int fd, save_errno;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+        goto error;
+    if (! S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        goto error;
+    }
+    if (st.st_size > INT_MAX) {
+        errno = EFBIG;
+        goto error;
+    }
+    fm->len = st.st_size;
+    if (fm->len >= MAP_FILE_MIN_LEN) {
+        void *p = mmap(NULL, fm->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            goto error;
+        fm->text = p;
+        fm->mapped = 1;
+    } else if (read_fd(fd, fm) < 0) {
+        goto error;
+    }
+    close(fd);
+    return 0;
+ error:
+    save_errno = errno;
+    close(fd);
+    errno = save_errno;
+    MEMZERO(fm, 1);
+    return -1;
+#else
+    char *buf = xread_file(path);
+    if (buf == NULL)
+        return -1;
+    fm->text = buf;
+    fm->len = strlen(buf);
+    return 0;
+#endif
+}
+
+void unmap_file(struct file_map *fm) {
+    if (fm->text == NULL)
+        return;
+#if HAVE_MMAP
+    if (fm->mapped)
+        munmap((void *) fm->text, fm->len);
+    else
+#endif
+        free((char *) fm->text);
+    MEMZERO(fm, 1);
+}
+
 /*
  * Escape/unescape of string literals
  */
@@ -331,6 +429,71 @@ int __hera_close_memstream(struct memstream *ms) {
     return 0;
 }
 
+/* Pass all of BUF to WS->WRITE, which may take it in several pieces */
+static int writestream_write_all(struct writestream *ws,
+                                 const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = ws->write(ws->data, buf, len);
+        if (n <= 0) {
+            if (ws->errnum == 0)
+                ws->errnum = (n < 0 && errno != 0) ? errno : EIO;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#if HAVE_FOPENCOOKIE
+static ssize_t writestream_cookie_write(void *cookie,
+                                        const char *buf, size_t len) {
+    struct writestream *ws = cookie;
+
+    if (ws->errnum != 0 || writestream_write_all(ws, buf, len) < 0)
+        return 0;
+    return len;
+}
+#endif
+
+int init_writestream(struct writestream *ws, hera_write_t write, void *data) {
+    MEMZERO(ws, 1);
+    ws->write = write;
+    ws->data = data;
+#if HAVE_FOPENCOOKIE
+    cookie_io_functions_t io = { .write = writestream_cookie_write };
+    ws->stream = fopencookie(ws, "w", io);
+#else
+    ws->stream = tmpfile();
+#endif
+    return ws->stream == NULL ? -1 : 0;
+}
+
+int close_writestream(struct writestream *ws) {
+    int r = 0;
+
+#if !HAVE_FOPENCOOKIE
+    char buf[BUFSIZ];
+    size_t n;
+
+    rewind(ws->stream);
+    while ((n = fread(buf, 1, sizeof(buf), ws->stream)) > 0) {
+        if (writestream_write_all(ws, buf, n) < 0)
+            break;
+    }
+    if (ferror(ws->stream) && ws->errnum == 0)
+        ws->errnum = EIO;
+#endif
+    if (fclose(ws->stream) == EOF && ws->errnum == 0)
+        ws->errnum = (errno != 0) ? errno : EIO;
+    ws->stream = NULL;
+    if (ws->errnum != 0) {
+        errno = ws->errnum;
+        r = -1;
+    }
+    return r;
+}
+
 char *path_expand(struct tree *tree, const char *ppath) {
     struct tree *siblings = tree->parent->children;
 
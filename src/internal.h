@@ -107,6 +107,16 @@
    spec files */
 #define HERACLES_LENS_ENV "HERACLES_LENS_LIB"
 
+/* Define: HERACLES_CACHE_ENV
+ * Name of env var that contains the directory in which compiled modules
+ * are cached. Caching is off when it is not set */
+#define HERACLES_CACHE_ENV "HERACLES_CACHE_DIR"
+
+/* Define: HERACLES_DFA_ENV
+ * Name of env var that, when set, makes us find the extent of regexp
+ * matches with a DFA, and only use the regexp engine for registers */
+#define HERACLES_DFA_ENV "HERACLES_DFA_MATCH"
+
 /* Define: MAX_ENV_SIZE
  * Fairly arbitrary bound on the length of the path we
  *  accept from HERACLES_SPEC_ENV */
@@ -290,6 +300,26 @@ char* xread_file(const char *path);
 /* Like xread_file, but caller supplies a file pointer */
 char* xfread_file(FILE *fp);
 
+/* Struct: file_map
+ * A read-only view of the contents of a file, set up by MAP_FILE. TEXT
+ * holds LEN bytes and is not necessarily NUL-terminated.
+ */
+struct file_map {
+    const char *text;
+    size_t      len;
+    int         mapped;
+};
+
+/* Function: map_file
+ * Make the contents of file PATH available in FM. Small files are read
+ * into a buffer; larger ones are mapped without copying them where the
+ * system supports mmap. Accessing a mapping past the end of a file that
+ * has been truncated since raises SIGBUS. Return 0 on success, and -1
+ * with errno set on error. FM must be released with UNMAP_FILE.
+ */
+int map_file(const char *path, struct file_map *fm);
+void unmap_file(struct file_map *fm);
+
 /* Get the error message for ERRNUM in a threadsafe way. Based on libvirt's
  * virStrError
  */
@@ -325,9 +355,14 @@ struct heracles {
                                   /* always ends with '/' */
     unsigned int      flags;      /* Flags passed to HERA_INIT */
     struct module    *modules;    /* Loaded modules */
+    struct hash_t    *modtable;   /* MODULES indexed by name */
     size_t            nmodpath;
     char             *modpathz;   /* The search path for modules as a
                                      glibc argz vector */
+    struct hash_t    *modindex;   /* Module file names on the search path,
+                                     mapped to their full path */
+    struct module_cache *cache;   /* Compiled modules on disk, or NULL */
+    struct lens_pins *frozen;     /* Set by HERA_FREEZE, NULL before */
     struct pathx_symtab *symtab;
     struct error        *error;
     uint                api_entries;  /* Number of entries through a public
@@ -369,6 +404,14 @@ void api_exit(const struct heracles *hera);
  * marked dirty, too. Instead of setting this flag directly, the function
  * TREE_MARK_DIRTY in heracles.c should be used (and only functions in that
  * file should have a need to mark nodes as dirty)
+ *
+ * If ARENA is not NULL, the node, its label, value and span are owned by
+ * the arena and only released with it; FREE_TREE_NODE leaves them alone.
+ * Labels and values of such nodes must only be changed with
+ * TREE_STORE_VALUE and TREE_SET_VALUE, which hand the new string to the
+ * arena, too. The label of such a node is always interned in its arena,
+ * so that two of its nodes have the same label exactly if their LABEL
+ * pointers are equal.
  */
 struct tree {
     struct tree *next;
@@ -378,6 +421,7 @@ struct tree {
     char        *value;
     int          dirty;
     struct span *span;
+    struct tree_arena *arena;
 };
 
 /* The opaque structure used to represent path expressions. API's
@@ -394,6 +438,45 @@ struct pathx;
 struct tree *make_tree(char *label, char *value,
                        struct tree *parent, struct tree *children);
 
+/* Function: make_arena_tree
+ * Like MAKE_TREE, but the node is allocated from ARENA. LABEL must be
+ * interned in ARENA, and VALUE must come from ARENA or be adopted by it
+ */
+struct tree *make_arena_tree(struct tree_arena *arena, char *label,
+                             char *value, struct tree *children);
+
+/* Tree arenas hold all the nodes and strings of trees built by get, so
+ * that they can be released with one call instead of node by node.
+ * Memory handed out by an arena is never freed individually. Strings
+ * and nodes allocated with malloc can be adopted by the arena, which
+ * then frees them when it is released */
+struct tree_arena *make_tree_arena(void);
+void free_tree_arena(struct tree_arena *arena);
+/* Return SIZE bytes suitably aligned for any tree structure, or NULL */
+void *tree_arena_alloc(struct tree_arena *arena, size_t size);
+/* Return a NUL-terminated copy of the first LEN bytes of S, or NULL */
+char *tree_arena_strndup(struct tree_arena *arena, const char *s,
+                         size_t len);
+/* Return ARENA's copy of the first LEN bytes of S as a NUL-terminated
+ * string, making one if there is none yet, or NULL if we run out of
+ * memory. Interned strings must never be changed */
+char *tree_arena_intern(struct tree_arena *arena, const char *s,
+                        size_t len);
+/* Make sure the next N calls to TREE_ARENA_ADOPT succeed. Return -1 if
+ * we run out of memory, 0 otherwise */
+int tree_arena_reserve(struct tree_arena *arena, size_t n);
+/* Free P, which was allocated with malloc, when ARENA is released. P can
+ * be NULL. Return -1 if we run out of memory, in which case P is not
+ * adopted, and 0 otherwise */
+int tree_arena_adopt(struct tree_arena *arena, void *p);
+
+/* Copy TREE and its siblings into the arrays of a HERA_FLAT, as described
+ * for HERA_GET_FLAT. Labels that are the same string, and not just equal,
+ * are stored once. Return NULL if we run out of memory or the tree is too
+ * big to be indexed with an int */
+struct hera_flat *tree_flatten(struct tree *tree);
+void free_hera_flat(struct hera_flat *flat);
+
 /* Mark a tree as a standalone tree; this creates a fake parent for ROOT,
  * so that even ROOT has a parent. A new node with only child ROOT is
  * returned on success, and NULL on failure.
@@ -480,6 +563,32 @@ int __hera_init_memstream(struct memstream *ms);
 int __hera_close_memstream(struct memstream *ms);
 #define close_memstream(ms) __hera_close_memstream(ms)
 
+/* Struct: writestream
+ * A stream whose output is handed to WRITE as it is produced, so that
+ * only the stdio buffer is held in memory. On systems without FOPENCOOKIE,
+ * STREAM is backed by a temporary file, which CLOSE_WRITESTREAM passes to
+ * WRITE piece by piece.
+ */
+struct writestream {
+    FILE         *stream;
+    hera_write_t  write;
+    void         *data;
+    int           errnum;   /* errno of the first failed write, or 0 */
+};
+
+/* Function: init_writestream
+ * Open WS->STREAM so that its output goes to WRITE, which is called with
+ * DATA as its first argument. WS must stay where it is until it is
+ * closed.
+ */
+int init_writestream(struct writestream *ws, hera_write_t write, void *data);
+
+/* Function: close_writestream
+ * Flush and close WS->STREAM. Return -1 with errno set if any write
+ * failed, and 0 otherwise.
+ */
+int close_writestream(struct writestream *ws);
+
 /*
  * Path expressions
  */
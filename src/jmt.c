@@ -231,6 +231,8 @@ struct jmt_parse {
     struct jmt       *jmt;
     struct error     *error;
     const char       *text;
+    bool              nl;        /* See JMT_PARSE */
+    char             *text_nl;   /* TEXT with that newline, see PARSE_MATCH */
     ind_t             nsets;
     struct item_set **sets;
 };
@@ -515,7 +517,8 @@ static void ncallee(struct jmt_parse *parse, ind_t j, ATTRIBUTE_UNUSED ind_t ite
 }
 
 static struct jmt_parse *parse_init(struct jmt *jmt,
-                                    const char *text, size_t text_len) {
+                                    const char *text, size_t text_len,
+                                    bool nl) {
     int r;
     struct jmt_parse *parse;
 
@@ -525,6 +528,7 @@ static struct jmt_parse *parse_init(struct jmt *jmt,
     parse->jmt = jmt;
     parse->error = jmt->error;
     parse->text = text;
+    parse->nl = nl;
     parse->nsets = text_len + 1;
     r = ALLOC_N(parse->sets, parse->nsets);
     ERR_NOMEM(r < 0, jmt);
@@ -549,6 +553,7 @@ void jmt_free_parse(struct jmt_parse *parse) {
         }
     }
     free(parse->sets);
+    free(parse->text_nl);
     free(parse);
 }
 
@@ -610,8 +615,10 @@ static void parse_dot_link(FILE *fp, struct jmt_parse *parse,
                 "    n%d_%d_%d -> n%d_%d_%d [ label = \"",
                 k, x->state->num, x->parent,
                 lnk->from_set, y->state->num, y->parent);
-        for (ind_t i=lnk->from_set; i < k; i++)
-            fprintf(fp, "%c", parse->text[i]);
+        for (ind_t i=lnk->from_set; i < k; i++) {
+            bool nl = parse->nl && i == parse->nsets - 2;
+            fprintf(fp, "%c", nl ? '\n' : parse->text[i]);
+        }
         fprintf(fp, "\" ];\n");
 
     } else if (is_predict(lnk)) {
@@ -654,12 +661,36 @@ static void parse_dot(struct jmt_parse *parse, const char *fname) {
     fclose(fp);
 }
 
+/* Match RE against the TEXT_LEN characters of PARSE's text from J on.
+ * When the text takes in a newline that is not in PARSE->TEXT, and
+ * REGEXP_MATCH_2 can't match over it without copying the text, match on
+ * PARSE->TEXT_NL, which is made only once */
+static int parse_match(struct jmt_parse *parse, struct regexp *re,
+                       size_t text_len, int j) {
+    int count;
+
+    if (! parse->nl)
+        return regexp_match(re, parse->text, text_len, j, NULL);
+    count = regexp_match_2(re, parse->text, text_len - 1, "\n", 1, j, NULL);
+    if (count != -4)
+        return count;
+    if (parse->text_nl == NULL) {
+        if (ALLOC_N(parse->text_nl, text_len) < 0) {
+            report_error(parse->error, HERA_ENOMEM, NULL);
+            return -2;
+        }
+        memcpy(parse->text_nl, parse->text, text_len - 1);
+        parse->text_nl[text_len - 1] = '\n';
+    }
+    return regexp_match(re, parse->text_nl, text_len, j, NULL);
+}
+
 struct jmt_parse *
-jmt_parse(struct jmt *jmt, const char *text, size_t text_len)
+jmt_parse(struct jmt *jmt, const char *text, size_t text_len, bool nl)
 {
     struct jmt_parse *parse = NULL;
 
-    parse = parse_init(jmt, text, text_len);
+    parse = parse_init(jmt, text, text_len, nl);
     ERR_BAIL(jmt);
 
     /* INIT */
@@ -707,7 +738,8 @@ jmt_parse(struct jmt *jmt, const char *text, size_t text_len)
                         /* SCAN, terminal */
                         // FIXME: We really need to find every k so that
                         // text[j..k] matches lens->ctype, not just one
-                        count = regexp_match(lens->ctype, text, text_len, j, NULL);
+                        count = parse_match(parse, lens->ctype,
+                                            text_len, j);
                         if (count > 0) {
                             parse_add_scan(parse, j+count,
                                            x->to, i,
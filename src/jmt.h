@@ -51,7 +51,10 @@ struct jmt_visitor {
 
 struct jmt *jmt_build(struct lens *l);
 
-struct jmt_parse *jmt_parse(struct jmt *jmt, const char *text, size_t text_len);
+/* Parse the TEXT_LEN characters at TEXT. If NL is set, the last of them
+ * is a newline that is not stored at TEXT */
+struct jmt_parse *jmt_parse(struct jmt *jmt, const char *text, size_t text_len,
+                            bool nl);
 
 void jmt_free_parse(struct jmt_parse *);
 
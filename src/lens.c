@@ -1009,6 +1009,8 @@ void free_lens(struct lens *lens) {
         for (int i=0; i < lens->nchildren; i++)
             unref(lens->children[i], lens);
         free(lens->children);
+        free(lens->ctype_regs);
+        free(lens->atype_regs);
         break;
     case L_REC:
         if (!lens->rec_internal) {
@@ -1055,6 +1057,128 @@ void lens_release(struct lens *lens) {
     lens->jmt = NULL;
 }
 
+/* Every child takes up one group for itself plus the groups in its type;
+ * REGEXP_CONCAT_N and REGEXP_UNION_N leave out children without a type */
+static unsigned int *child_regs(struct lens *lens, enum lens_type t) {
+    unsigned int *regs = NULL;
+
+    if (ALLOC_N(regs, lens->nchildren + 1) < 0)
+        return NULL;
+    regs[0] = 1;
+    for (int i=0; i < lens->nchildren; i++) {
+        struct regexp *r = ltype(lens->children[i], t);
+        regs[i+1] = regs[i] + ((r == NULL) ? 0 : 1 + regexp_nsub(r));
+    }
+    return regs;
+}
+
+const unsigned int *lns_ctype_regs(struct lens *lens) {
+    assert(lens->tag == L_CONCAT || lens->tag == L_UNION);
+    if (lens->ctype_regs == NULL)
+        lens->ctype_regs = child_regs(lens, CTYPE);
+    return lens->ctype_regs;
+}
+
+const unsigned int *lns_atype_regs(struct lens *lens) {
+    assert(lens->tag == L_CONCAT || lens->tag == L_UNION);
+    if (lens->atype_regs == NULL)
+        lens->atype_regs = child_regs(lens, ATYPE);
+    return lens->atype_regs;
+}
+
+static int freeze_regexp(struct lens *lens, struct regexp *r) {
+    if (r == NULL)
+        return 0;
+    if (regexp_compile(r) < 0) {
+        report_error(lens->info->error, HERA_EINTERNAL,
+                     "could not compile regexp /%s/", r->pattern->str);
+        return -1;
+    }
+    return 0;
+}
+
+static int pin_lens(struct lens *lens, struct lens_pins *pins) {
+    if (pins->npins == pins->size) {
+        size_t size = pins->size == 0 ? 64 : 2 * pins->size;
+        if (REALLOC_N(pins->lenses, size) < 0
+            || REALLOC_N(pins->refs, size) < 0) {
+            report_error(lens->info->error, HERA_ENOMEM, NULL);
+            return -1;
+        }
+        pins->size = size;
+    }
+    pins->lenses[pins->npins] = lens;
+    pins->refs[pins->npins] = lens->ref;
+    pins->npins += 1;
+    ref_pin(lens);
+    return 0;
+}
+
+/* Pinned lenses have already been visited; that also keeps us from going
+ * around in circles in recursive lenses */
+static int freeze_graph(struct lens *lens, struct lens_pins *pins) {
+    if (lens == NULL || lens->ref == REF_MAX)
+        return 0;
+    if (pin_lens(lens, pins) < 0)
+        return -1;
+
+    for (int t=0; t < ntypes; t++)
+        if (freeze_regexp(lens, ltype(lens, t)) < 0)
+            return -1;
+
+    switch (lens->tag) {
+    case L_DEL:
+    case L_STORE:
+    case L_KEY:
+        return freeze_regexp(lens, lens->regexp);
+    case L_SUBTREE:
+    case L_STAR:
+    case L_MAYBE:
+    case L_SQUARE:
+        return freeze_graph(lens->child, pins);
+    case L_CONCAT:
+    case L_UNION:
+        for (int i=0; i < lens->nchildren; i++)
+            if (freeze_graph(lens->children[i], pins) < 0)
+                return -1;
+        if (lns_ctype_regs(lens) == NULL || lns_atype_regs(lens) == NULL) {
+            report_error(lens->info->error, HERA_ENOMEM, NULL);
+            return -1;
+        }
+        return 0;
+    case L_REC:
+        if (freeze_graph(lens->body, pins) < 0)
+            return -1;
+        return freeze_graph(lens->alias, pins);
+    default:
+        return 0;
+    }
+}
+
+int lns_freeze(struct lens *lens, struct lens_pins *pins) {
+    if (freeze_graph(lens, pins) < 0)
+        return -1;
+
+    /* Only lenses that get and put are started on need a jmt; this is
+     * what rec_process would otherwise build on first use */
+    if (lens->recursive && lens->jmt == NULL) {
+        lens->jmt = jmt_build(lens);
+        ERR_BAIL(lens->info);
+    }
+    return 0;
+ error:
+    return -1;
+}
+
+void lns_thaw(struct lens_pins *pins) {
+    for (size_t i=0; i < pins->npins; i++)
+        pins->lenses[i]->ref = pins->refs[i];
+    FREE(pins->lenses);
+    FREE(pins->refs);
+    pins->npins = 0;
+    pins->size = 0;
+}
+
 /*
  * Encoding of tree levels
  */
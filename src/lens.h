@@ -98,6 +98,10 @@ struct lens {
         struct {                    /* L_UNION, L_CONCAT */
             unsigned int nchildren;
             struct lens **children;
+            /* Registers of the children in matches against the ctype and
+             * the atype, filled in by LNS_CTYPE_REGS and LNS_ATYPE_REGS */
+            unsigned int *ctype_regs;
+            unsigned int *atype_regs;
         };
         struct {
             struct lens *body;      /* L_REC */
@@ -168,11 +172,39 @@ struct skel {
     /* Also tag == L_SUBTREE, with no data in the union */
 };
 
+/* What an error is about. Errors whose message would be expensive to
+ * put together only record what they need for it, and LNS_ERROR_MESSAGE
+ * formats the message when it is first asked for */
+enum lns_error_kind {
+    LNS_ERROR_MESSAGE,    /* MESSAGE was formatted when the error was made */
+    LNS_ERROR_EXPECTED,   /* get: the ctype of LENS is not at TEXT */
+    LNS_ERROR_NO_MATCH,   /* get: no match for the key, del or store LENS */
+    LNS_ERROR_TREE,       /* put: the atype of LENS failed to match the
+                           * encoded tree TEXT with COUNT */
+    LNS_ERROR_STORE       /* put: the value TEXT does not match the regexp
+                           * of the store LENS */
+};
+
 struct lns_error {
     struct lens  *lens;
     int           pos;        /* Errors from get/parse */
     char         *path;       /* Errors from put, pos will be -1 */
-    char         *message;
+    char         *message;    /* Use LNS_ERROR_MESSAGE to read this */
+    enum lns_error_kind kind;
+    char         *text;       /* Depends on KIND */
+    int           count;      /* LNS_ERROR_TREE */
+};
+
+/* Return the message of ERR, formatting it if that has not happened
+ * yet. Return NULL if we run out of memory */
+const char *lns_error_message(struct lns_error *err);
+
+/* The skeleton and dictionary of a text, as built by parsing it with
+ * LENS. Put needs them to reproduce the formatting of the original text */
+struct lns_parse {
+    struct lens  *lens;
+    struct skel  *skel;
+    struct dict  *dict;
 };
 
 struct dict *make_dict(char *key, struct skel *skel, struct dict *subdict);
@@ -182,6 +214,7 @@ int dict_append(struct dict **dict, struct dict *d2);
 void free_skel(struct skel *skel);
 void free_dict(struct dict *dict);
 void free_lns_error(struct lns_error *err);
+void free_lns_parse(struct lns_parse *parse);
 
 /* Parse text TEXT with LENS. INFO indicats where TEXT was read from.
  *
@@ -196,14 +229,100 @@ struct tree *lns_get(struct info *info, struct lens *lens, const char *text,
                      struct lns_error **err);
 struct skel *lns_parse(struct lens *lens, const char *text,
                        struct dict **dict, struct lns_error **err);
+
+/* Like LNS_GET and LNS_PARSE, but TEXT is LEN bytes long and does not need
+ * to be NUL-terminated. TEXT is never modified. If ADD_NEWLINE is set, a
+ * missing newline at the end of TEXT is supplied by the parser.
+ */
+struct tree *lns_get_n(struct info *info, struct lens *lens,
+                       const char *text, size_t len, int add_newline,
+                       struct lns_error **err);
+struct skel *lns_parse_n(struct lens *lens, const char *text, size_t len,
+                         int add_newline, struct dict **dict,
+                         struct lns_error **err);
+/* Like LNS_GET_N, but if PARSE is not NULL, also build what LNS_PARSE_N
+ * would for TEXT in the same pass over it. *PARSE is set to NULL if there
+ * is an error, and to the result of the parse otherwise, which the caller
+ * must pass to LNS_PUT_PARSE or free with FREE_LNS_PARSE */
+struct tree *lns_get_parse(struct info *info, struct lens *lens,
+                           const char *text, size_t len, int add_newline,
+                           struct lns_parse **parse, struct lns_error **err);
+/* Like LNS_GET_N, but allocate the tree and its strings from ARENA. If
+ * SLICES is not NULL, copy TEXT into ARENA, set *SLICES to that copy and
+ * make values point into it where possible, rather than copying each of
+ * them */
+struct tree *lns_get_arena(struct info *info, struct lens *lens,
+                           const char *text, size_t len, int add_newline,
+                           struct tree_arena *arena, const char **slices,
+                           struct lns_error **err);
+/* Like LNS_GET_N, but pass the toplevel nodes of the tree to FN one at a
+ * time. When LENS has the common form (l)*, each iteration of l is passed
+ * on as soon as it has been processed, and no more than one of them is
+ * held in memory.
+ *
+ * Return -1 if TEXT does not parse, with *ERR set as for LNS_GET_N, 1 if
+ * FN asked us to stop, and 0 otherwise. Nodes passed to FN before an error
+ * was found stay with FN */
+int lns_get_stream(struct info *info, struct lens *lens,
+                   const char *text, size_t len, int add_newline,
+                   hera_emit_t fn, void *data, struct lns_error **err);
+/* Like LNS_GET_N, but instead of making a tree, tell BUILDER about each of
+ * its nodes, as described for HERA_GET_BUILD. Return values are as for
+ * LNS_GET_STREAM */
+int lns_get_build(struct info *info, struct lens *lens,
+                  const char *text, size_t len, int add_newline,
+                  const struct hera_builder *builder, void *data,
+                  struct lns_error **err);
 void lns_put(FILE *out, struct lens *lens, struct tree *tree,
              const char *text, struct lns_error **err);
+/* Like LNS_PUT, with TEXT handled as in LNS_PARSE_N */
+void lns_put_n(FILE *out, struct lens *lens, struct tree *tree,
+               const char *text, size_t len, int add_newline,
+               struct lns_error **err);
+/* Like LNS_PUT, with the original text described by PARSE from
+ * LNS_GET_PARSE instead of parsing it again. PARSE is used up and freed,
+ * whether the put succeeds or not */
+void lns_put_parse(FILE *out, struct lens *lens, struct tree *tree,
+                   struct lns_parse *parse, struct lns_error **err);
+/* Like LNS_PUT_N, for a TREE that was parsed from TEXT with spans. Nodes
+ * that are still clean are written as the text they were parsed from
+ * rather than put with their lens. PARSE is NULL or the parse LNS_GET_PARSE
+ * made along with TREE, which saves parsing TEXT again, and is used up as
+ * in LNS_PUT_PARSE */
+void lns_put_spans(FILE *out, struct lens *lens, struct tree *tree,
+                   const char *text, size_t len, int add_newline,
+                   struct lns_parse *parse, struct lns_error **err);
+
+/* For an L_CONCAT or L_UNION LENS, return a table that gives, for each
+ * child I, the register matching it when matching the ctype (resp. atype)
+ * of LENS. Entry NCHILDREN is one past the registers of the last child.
+ * The table is computed on first use and kept with LENS; return NULL if
+ * we run out of memory */
+const unsigned int *lns_ctype_regs(struct lens *lens);
+const unsigned int *lns_atype_regs(struct lens *lens);
 
 /* Free up temporary data structures, most importantly compiled
    regular expressions */
 void lens_release(struct lens *lens);
 void free_lens(struct lens *lens);
 
+/* Lenses pinned by LNS_FREEZE, with their original reference counts */
+struct lens_pins {
+    size_t         npins;
+    size_t         size;
+    struct lens  **lenses;
+    unsigned int  *refs;
+};
+
+/* Prepare LENS so that get and put can use it from several threads at
+ * once: compile every regexp reachable from it, build its jmt if it is
+ * recursive, and pin every lens in its graph so that get and put never
+ * write a reference count. The pinned lenses are recorded in PINS. Return
+ * -1 on failure, with the error reported in LENS->INFO */
+int lns_freeze(struct lens *lens, struct lens_pins *pins);
+/* Give the lenses in PINS back their reference counts */
+void lns_thaw(struct lens_pins *pins);
+
 /*
  * Encoding of tree levels into strings
  */
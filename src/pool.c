@@ -0,0 +1,203 @@
+/*
+ * pool.c: run independent jobs on a work-stealing pool of threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "internal.h"
+#include "memory.h"
+
+/* Each worker owns a queue of job numbers. The owner takes jobs from the
+ * front, where the expensive ones are; thieves take them from the back */
+struct queue {
+    pthread_mutex_t  lock;
+    size_t           head;
+    size_t           tail;     /* One past the last job in the queue */
+    size_t          *jobs;
+};
+
+struct pool {
+    unsigned int     nworkers;
+    struct queue    *queues;
+    pool_job_t       run;
+    void            *data;
+};
+
+struct worker {
+    struct pool     *pool;
+    unsigned int     self;
+};
+
+struct job_cost {
+    size_t job;
+    size_t cost;
+};
+
+unsigned int pool_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+}
+
+static int job_cost_cmp(const void *p1, const void *p2) {
+    const struct job_cost *c1 = p1, *c2 = p2;
+
+    if (c1->cost != c2->cost)
+        return c1->cost < c2->cost ? 1 : -1;
+    return c1->job < c2->job ? -1 : c1->job > c2->job;
+}
+
+static bool take(struct queue *q, size_t *job) {
+    bool found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *job = q->jobs[q->head++];
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static bool steal(struct queue *q, size_t *job) {
+    bool found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *job = q->jobs[--q->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Jobs are never added once the workers are running, so a worker can
+ * stop as soon as it finds every queue empty */
+static void *work(void *arg) {
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+    size_t job;
+
+    for (;;) {
+        if (take(pool->queues + w->self, &job)) {
+            pool->run(pool->data, job);
+            continue;
+        }
+        bool stolen = false;
+        for (unsigned int i=1; i < pool->nworkers && !stolen; i++) {
+            unsigned int victim = (w->self + i) % pool->nworkers;
+            stolen = steal(pool->queues + victim, &job);
+        }
+        if (! stolen)
+            break;
+        pool->run(pool->data, job);
+    }
+    return NULL;
+}
+
+void pool_run(size_t njobs, const size_t *cost, unsigned int nthreads,
+              pool_job_t run, void *data) {
+    struct pool pool;
+    struct job_cost *order = NULL;
+    struct worker *workers = NULL;
+    pthread_t *threads = NULL;
+    unsigned int nstarted = 0;
+    size_t *jobs = NULL;
+
+    MEMZERO(&pool, 1);
+    if (nthreads == 0)
+        nthreads = pool_default_threads();
+    if (nthreads > njobs)
+        nthreads = njobs;
+    if (nthreads <= 1)
+        goto serial;
+
+    pool.run = run;
+    pool.data = data;
+    pool.nworkers = nthreads;
+
+    if (ALLOC_N(order, njobs) < 0 || ALLOC_N(jobs, njobs) < 0
+        || ALLOC_N(pool.queues, nthreads) < 0
+        || ALLOC_N(workers, nthreads) < 0
+        || ALLOC_N(threads, nthreads) < 0)
+        goto serial;
+
+    for (size_t i=0; i < njobs; i++) {
+        order[i].job = i;
+        order[i].cost = (cost == NULL) ? 0 : cost[i];
+    }
+    if (cost != NULL)
+        qsort(order, njobs, sizeof(*order), job_cost_cmp);
+
+    /* Deal the jobs out like cards, so that every queue starts with a
+     * fair share of the expensive ones */
+    size_t used = 0;
+    for (unsigned int q=0; q < nthreads; q++) {
+        pthread_mutex_init(&pool.queues[q].lock, NULL);
+        pool.queues[q].jobs = jobs + used;
+        pool.queues[q].head = 0;
+        for (size_t i=q; i < njobs; i += nthreads)
+            pool.queues[q].jobs[pool.queues[q].tail++] = order[i].job;
+        used += pool.queues[q].tail;
+        workers[q].pool = &pool;
+        workers[q].self = q;
+    }
+    FREE(order);
+
+    /* The calling thread is worker 0 */
+    for (unsigned int q=1; q < nthreads; q++) {
+        if (pthread_create(threads + q, NULL, work, workers + q) != 0)
+            break;
+        nstarted += 1;
+    }
+    work(workers);
+    for (unsigned int q=1; q <= nstarted; q++)
+        pthread_join(threads[q], NULL);
+
+    /* Worker 0 steals from every queue, including those of workers that
+     * were never started, so nothing is left at this point */
+    for (unsigned int q=0; q < nthreads; q++)
+        pthread_mutex_destroy(&pool.queues[q].lock);
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    free(jobs);
+    return;
+
+ serial:
+    free(pool.queues);
+    free(order);
+    free(workers);
+    free(threads);
+    free(jobs);
+    for (size_t i=0; i < njobs; i++)
+        run(data, i);
+}
+
+/*
+ * Local variables:
+ *  indent-tabs-mode: nil
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  tab-width: 4
+ * End:
+ */
@@ -0,0 +1,56 @@
+/*
+ * pool.h: run independent jobs on a work-stealing pool of threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+typedef void (*pool_job_t)(void *data, size_t job);
+
+/* The number of threads to use when the caller does not say */
+unsigned int pool_default_threads(void);
+
+/* Call RUN(DATA, i) for every i in [0, NJOBS) on NTHREADS threads, one of
+ * which is the calling thread. If NTHREADS is 0, use
+ * POOL_DEFAULT_THREADS.
+ *
+ * COST, if not NULL, gives an estimate of how long each job takes. Every
+ * thread works through its own share of the jobs starting with the most
+ * expensive ones, and threads that run out of work steal the cheapest
+ * jobs left over by others, so that one long job never holds up shorter
+ * ones queued behind it.
+ *
+ * All jobs have been run when this returns. If we can't start threads or
+ * allocate the queues, the calling thread runs whatever is left by
+ * itself.
+ */
+void pool_run(size_t njobs, const size_t *cost, unsigned int nthreads,
+              pool_job_t run, void *data);
+
+#endif
+
+
+/*
+ * Local variables:
+ *  indent-tabs-mode: nil
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  tab-width: 4
+ * End:
+ */
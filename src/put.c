@@ -44,9 +44,17 @@
  * where the label/value pairs come from TREE and its
  * siblings. The encoding uses ENC_EQ instead of the '=' above to avoid
  * clashes with legitimate values, and encodes NULL values as ENC_NULL.
+ * START and END delimit the part of the encoding that belongs to the split.
+ *
+ * Splits that refine another split share its encoding, which is owned by
+ * the split BASE made by MAKE_SPLIT. Most matches run the automaton for a
+ * lens' atype directly over the labels and values in the tree, and never
+ * look at the encoding; it is only built once something needs it, and must
+ * be accessed with SPLIT_ENC.
  */
 struct split {
     struct split *next;
+    struct split *base;
     struct tree  *tree;
     struct tree  *follow;
     char         *enc;
@@ -65,21 +73,29 @@ struct state {
     char             *path;   /* Position in the tree, for errors */
     size_t            pos;
     struct lns_error *error;
+    /* The original text, when nodes that are still clean are copied from
+     * it instead of being put; TEXT_NL is 1 if the parse supplied a
+     * final newline that is not in TEXT */
+    const char       *text;
+    size_t            text_len;
+    int               text_nl;
 };
 
 static void create_lens(struct lens *lens, struct state *state);
 static void put_lens(struct lens *lens, struct state *state);
 
-static void put_error(struct state *state, struct lens *lens,
-                      const char *format, ...)
-{
-    va_list ap;
-    int r;
-
+/* Record an error of KIND for LENS in STATE and return it, or return NULL
+ * if STATE already has an error */
+static struct lns_error *make_put_error(struct state *state,
+                                        struct lens *lens,
+                                        enum lns_error_kind kind) {
     if (state->error != NULL)
-        return;
+        return NULL;
 
     CALLOC(state->error, 1);
+    if (state->error == NULL)
+        return NULL;
+    state->error->kind = kind;
     state->error->lens = ref(lens);
     state->error->pos  = -1;
     if (strlen(state->path) == 0) {
@@ -87,12 +103,24 @@ static void put_error(struct state *state, struct lens *lens,
     } else {
         state->error->path = strdup(state->path);
     }
+    return state->error;
+}
+
+static void put_error(struct state *state, struct lens *lens,
+                      const char *format, ...)
+{
+    struct lns_error *err = make_put_error(state, lens, LNS_ERROR_MESSAGE);
+    va_list ap;
+    int r;
+
+    if (err == NULL)
+        return;
 
     va_start(ap, format);
-    r = vasprintf(&state->error->message, format, ap);
+    r = vasprintf(&err->message, format, ap);
     va_end(ap);
     if (r == -1)
-        state->error->message = NULL;
+        err->message = NULL;
 }
 
 ATTRIBUTE_PURE
@@ -109,30 +137,26 @@ static char *encpcpy(char *e, const char *key, const char *value) {
     return e;
 }
 
+static const char *split_enc(struct split *split);
+
+/* The message, with the atype of LENS and the tree, is only formatted
+ * when someone asks for it, see lns_error_message */
 static void regexp_match_error(struct state *state, struct lens *lens,
                                int count, struct split *split) {
     // FIXME: Split the regexp and encoding back
     // into something resembling a tree level
-    char *text = NULL;
-    char *pat = NULL;
-
-    lns_format_atype(lens, &pat);
-    text = enc_format(split->enc + split->start, split->end - split->start);
+    struct lns_error *err;
+    const char *enc;
 
-    if (count == -1) {
-        put_error(state, lens,
-                  "Failed to match \n    %s\n  with tree\n   %s",
-                  pat, text);
-    } else if (count == -2) {
-        put_error(state, lens,
-                  "Internal error matching\n    %s\n  with tree\n   %s",
-                  pat, text);
-    } else if (count == -3) {
-        /* Should have been cheraht by the typechecker */
-        put_error(state, lens, "Syntax error in tree schema\n    %s", pat);
-    }
-    free(pat);
-    free(text);
+    if (count < -3)
+        return;
+    err = make_put_error(state, lens, LNS_ERROR_TREE);
+    if (err == NULL)
+        return;
+    err->count = count;
+    enc = split_enc(split);
+    if (enc != NULL && count != -3)
+        err->text = strndup(enc + split->start, split->end - split->start);
 }
 
 static void free_split(struct split *split) {
@@ -143,7 +167,8 @@ static void free_split(struct split *split) {
     free(split);
 }
 
-/* Encode the list of TREE's children as a string.
+/* Make a split for the list TREE. Its encoding is only built when
+ * SPLIT_ENC asks for it.
  */
 static struct split *make_split(struct tree *tree) {
     struct split *split;
@@ -151,32 +176,41 @@ static struct split *make_split(struct tree *tree) {
     if (ALLOC(split) < 0)
         return NULL;
 
+    split->base = split;
     split->tree = tree;
     list_for_each(t, tree) {
         split->end += enclen(t->label, t->value);
     }
+    return split;
+}
 
-    if (ALLOC_N(split->enc, split->end + 1) < 0)
-        goto error;
+/* Return the encoding that the offsets in SPLIT refer to, and build it
+ * first if nobody has needed it yet. Return NULL if we run out of memory
+ */
+static const char *split_enc(struct split *split) {
+    struct split *base = split->base;
 
-    char *enc = split->enc;
-    list_for_each(t, tree) {
-        enc = encpcpy(enc, t->label, t->value);
+    if (base->enc == NULL) {
+        if (ALLOC_N(base->enc, base->end + 1) < 0)
+            return NULL;
+
+        char *enc = base->enc;
+        list_for_each(t, base->tree) {
+            enc = encpcpy(enc, t->label, t->value);
+        }
     }
-    return split;
- error:
-    free_split(split);
-    return NULL;
+    return base->enc;
 }
 
 static struct split *split_append(struct split **split, struct split *tail,
+                                  struct split *base,
                                   struct tree *tree, struct tree *follow,
-                                  char *enc, size_t start, size_t end) {
+                                  size_t start, size_t end) {
     struct split *sp;
     CALLOC(sp, 1);
+    sp->base = base;
     sp->tree = tree;
     sp->follow = follow;
-    sp->enc = enc;
     sp->start = start;
     sp->end = end;
     list_tail_cons(*split, tail, sp);
@@ -199,6 +233,168 @@ static struct split *set_split(struct state *state, struct split *split) {
     return split;
 }
 
+/* Feed the encoding of the node TREE to the automaton for ATYPE, starting
+ * from STATE; see REGEXP_STEP */
+static int step_node(struct regexp *atype, int state, struct tree *tree,
+                     int *accept) {
+    const char *pieces[] = {
+        ENCSTR(tree->label), ENC_EQ, ENCSTR(tree->value), ENC_SLASH
+    };
+    return regexp_step(atype, state, pieces, ARRAY_CARDINALITY(pieces),
+                       accept);
+}
+
+/* Find the longest run of nodes starting at TREE, and ending before FOLLOW
+ * at the latest, whose encoding ATYPE matches, without building that
+ * encoding. Set *END to the node following the run and *LEN to the length
+ * of its encoding. Return 1 if there is such a run, 0 if there is none,
+ * and -1 if we can't tell
+ */
+static int match_nodes(struct regexp *atype,
+                       struct tree *tree, struct tree *follow,
+                       struct tree **end, size_t *len) {
+    int result = 0, state, accept;
+    size_t n = 0;
+
+    if (atype == NULL)
+        return -1;
+    state = regexp_step(atype, 0, NULL, 0, &accept);
+    if (state < 0)
+        return -1;
+    if (accept) {
+        *end = tree;
+        *len = 0;
+        result = 1;
+    }
+    for (struct tree *t = tree; t != follow; t = t->next) {
+        state = step_node(atype, state, t, &accept);
+        if (state == -1)
+            break;
+        if (state < 0)
+            return -1;
+        n += enclen(t->label, t->value);
+        if (accept) {
+            *end = t->next;
+            *len = n;
+            result = 1;
+        }
+    }
+    return result;
+}
+
+#define UNREACHED  -1
+#define AMBIGUOUS  -2
+
+/* Split the nodes of OUTER among the children of the concat LENS by
+ * running the automata for their atypes over the tree. Return 1 and put
+ * the splits into *SPLIT if that works, or if it fails with an error.
+ * Return 0 if we can't tell, and leave it to the regexp engine.
+ *
+ * The typechecker makes sure that a tree splits in at most one way, but
+ * lenses don't have to be typechecked; if we find several ways, we also
+ * return 0, so that those are split just like the regexp engine does.
+ */
+static int split_concat_nodes(struct state *state, struct lens *lens,
+                              struct split **split) {
+    struct split *outer = state->split;
+    struct split *tail = NULL;
+    struct node_pos {
+        struct tree *tree;
+        size_t       off;
+    } *node = NULL;
+    int *from = NULL;
+    int *bound = NULL;
+    int nnodes = 0, nchildren = lens->nchildren;
+    size_t work = 0, budget;
+    int result = 0;
+
+    for (struct tree *t = outer->tree; t != outer->follow; t = t->next)
+        nnodes += 1;
+
+    if (ALLOC_N(node, nnodes + 1) < 0
+        || ALLOC_N(from, (nchildren + 1) * (nnodes + 1)) < 0
+        || ALLOC_N(bound, nchildren + 1) < 0)
+        goto error;
+
+    node[0].tree = outer->tree;
+    node[0].off = outer->start;
+    for (int k=0; k < nnodes; k++) {
+        struct tree *t = node[k].tree;
+        node[k+1].tree = t->next;
+        node[k+1].off = node[k].off + enclen(t->label, t->value);
+    }
+
+    /* FROM[i * (NNODES+1) + e] is the node where child i-1 starts on the
+     * only way to match nodes 0 .. e-1 with children 0 .. i-1, UNREACHED
+     * if there is none and AMBIGUOUS if there are several */
+    for (int i=0; i < (nchildren + 1) * (nnodes + 1); i++)
+        from[i] = UNREACHED;
+    from[0] = 0;
+
+    /* Each child usually can start at just one node; give up on the
+     * rare lenses that make us try lots of them */
+    budget = 4 * (size_t) (nchildren + 1) * (nnodes + 1);
+    for (int i=0; i < nchildren; i++) {
+        struct regexp *atype = lens->children[i]->atype;
+        int *cur = from + i * (nnodes + 1);
+        int *next = cur + nnodes + 1;
+
+        if (atype == NULL)
+            goto done;
+        for (int s=0; s <= nnodes; s++) {
+            int st, accept;
+
+            if (cur[s] == UNREACHED)
+                continue;
+            st = regexp_step(atype, 0, NULL, 0, &accept);
+            if (st < 0)
+                goto done;
+            for (int e = s; ; e++) {
+                if (accept) {
+                    if (cur[s] == AMBIGUOUS || next[e] != UNREACHED)
+                        next[e] = AMBIGUOUS;
+                    else
+                        next[e] = s;
+                }
+                if (e == nnodes)
+                    break;
+                work += 1;
+                if (work > budget)
+                    goto done;
+                st = step_node(atype, st, node[e].tree, &accept);
+                if (st == -1)
+                    break;
+                if (st < 0)
+                    goto done;
+            }
+        }
+    }
+
+    bound[nchildren] = nnodes;
+    for (int i = nchildren; i > 0; i--) {
+        bound[i-1] = from[i * (nnodes + 1) + bound[i]];
+        if (bound[i-1] < 0)
+            goto done;
+    }
+
+    for (int i=0; i < nchildren; i++) {
+        struct node_pos *first = node + bound[i];
+        struct node_pos *last = node + bound[i+1];
+        tail = split_append(split, tail, outer->base, first->tree, last->tree,
+                            first->off, last->off);
+    }
+    result = 1;
+ done:
+    free(node);
+    free(from);
+    free(bound);
+    return result;
+ error:
+    put_error(state, lens, "Out of memory");
+    result = 1;
+    goto done;
+}
+
 /* Refine a tree split OUTER according to the L_CONCAT lens LENS */
 static struct split *split_concat(struct state *state, struct lens *lens) {
     assert(lens->tag == L_CONCAT);
@@ -208,21 +404,29 @@ static struct split *split_concat(struct state *state, struct lens *lens) {
     struct re_registers regs;
     struct split *split = NULL, *tail = NULL;
     struct regexp *atype = lens->atype;
+    const char *enc;
 
     /* Fast path for leaf nodes, which will always lead to an empty split */
     // FIXME: This doesn't match the empty encoding
-    if (outer->tree == NULL && strlen(outer->enc) == 0
+    if (outer->tree == NULL && outer->base->end == 0
         && regexp_is_empty_pattern(atype)) {
         for (int i=0; i < lens->nchildren; i++) {
-            tail = split_append(&split, tail, NULL, NULL,
-                                outer->enc, 0, 0);
+            tail = split_append(&split, tail, outer->base, NULL, NULL, 0, 0);
         }
         return split;
     }
 
+    if (split_concat_nodes(state, lens, &split))
+        return split;
+
+    enc = split_enc(outer);
+    if (enc == NULL) {
+        put_error(state, lens, "Out of memory");
+        return NULL;
+    }
+
     MEMZERO(&regs, 1);
-    count = regexp_match(atype, outer->enc, outer->end,
-                         outer->start, &regs);
+    count = regexp_match(atype, enc, outer->end, outer->start, &regs);
     if (count >= 0 && count != outer->end - outer->start)
         count = -1;
     if (count < 0) {
@@ -230,28 +434,33 @@ static struct split *split_concat(struct state *state, struct lens *lens) {
         goto error;
     }
 
+    const unsigned int *reg_of = lns_atype_regs(lens);
+    if (reg_of == NULL) {
+        put_error(state, lens, "Out of memory");
+        goto error;
+    }
+
     struct tree *cur = outer->tree;
-    int reg = 1;
     for (int i=0; i < lens->nchildren; i++) {
+        int reg = reg_of[i];
         assert(reg < regs.num_regs);
         assert(regs.start[reg] != -1);
         struct tree *follow = cur;
         for (int j = regs.start[reg]; j < regs.end[reg]; j++) {
-            if (outer->enc[j] == ENC_SLASH_CH)
+            if (enc[j] == ENC_SLASH_CH)
                 follow = follow->next;
         }
-        tail = split_append(&split, tail, cur, follow,
-                            outer->enc, regs.start[reg], regs.end[reg]);
+        tail = split_append(&split, tail, outer->base, cur, follow,
+                            regs.start[reg], regs.end[reg]);
         cur = follow;
-        reg += 1 + regexp_nsub(lens->children[i]->atype);
     }
-    assert(reg < regs.num_regs);
+    assert(reg_of[lens->nchildren] < regs.num_regs);
  done:
     free(regs.start);
     free(regs.end);
     return split;
  error:
-    free_split(split);
+    list_free(split);
     split = NULL;
     goto done;
 }
@@ -268,27 +477,42 @@ static struct split *split_iter(struct state *state, struct lens *lens) {
     int pos = outer->start;
     struct split *tail = NULL;
     while (pos < outer->end) {
-        count = regexp_match(atype, outer->enc, outer->end, pos, NULL);
-        if (count == -1) {
+        struct tree *follow = NULL;
+        size_t len;
+        int r = match_nodes(atype, cur, outer->follow, &follow, &len);
+
+        if (r == 0)
             break;
-        } else if (count < -1) {
-            regexp_match_error(state, lens->child, count, outer);
-            goto error;
-        }
+        if (r == 1) {
+            count = len;
+        } else {
+            const char *enc = split_enc(outer);
+            if (enc == NULL) {
+                put_error(state, lens, "Out of memory");
+                goto error;
+            }
+            count = regexp_match(atype, enc, outer->end, pos, NULL);
+            if (count == -1) {
+                break;
+            } else if (count < -1) {
+                regexp_match_error(state, lens->child, count, outer);
+                goto error;
+            }
 
-        struct tree *follow = cur;
-        for (int j = pos; j < pos + count; j++) {
-            if (outer->enc[j] == ENC_SLASH_CH)
-                follow = follow->next;
+            follow = cur;
+            for (int j = pos; j < pos + count; j++) {
+                if (enc[j] == ENC_SLASH_CH)
+                    follow = follow->next;
+            }
         }
-        tail = split_append(&split, tail, cur, follow,
-                            outer->enc, pos, pos + count);
+        tail = split_append(&split, tail, outer->base, cur, follow,
+                            pos, pos + count);
         cur = follow;
         pos += count;
     }
     return split;
  error:
-    free_split(split);
+    list_free(split);
     return NULL;
 }
 
@@ -296,16 +520,36 @@ static struct split *split_iter(struct state *state, struct lens *lens) {
 static int applies(struct lens *lens, struct state *state) {
     int count;
     struct split *split = state->split;
+    struct tree *end;
+    size_t len;
 
-    count = regexp_match(lens->atype, split->enc, split->end,
-                         split->start, NULL);
-    if (count < -1) {
-        regexp_match_error(state, lens, count, split);
+    switch (match_nodes(lens->atype, split->tree, split->follow,
+                        &end, &len)) {
+    case 0:
         return 0;
+    case 1:
+        if (end != split->follow)
+            return 0;
+        count = len;
+        break;
+    default: {
+        const char *enc = split_enc(split);
+        if (enc == NULL) {
+            put_error(state, lens, "Out of memory");
+            return 0;
+        }
+        count = regexp_match(lens->atype, enc, split->end,
+                             split->start, NULL);
+        if (count < -1) {
+            regexp_match_error(state, lens, count, split);
+            return 0;
+        }
+        if (count != split->end - split->start)
+            return 0;
+        break;
+    }
     }
 
-    if (count != split->end - split->start)
-        return 0;
     if (count == 0 && lens->value)
         return state->value != NULL;
     return 1;
@@ -431,6 +675,35 @@ static int skel_instance_of(struct lens *lens, struct skel *skel) {
     return 0;
 }
 
+/* If TREE has not changed since it was parsed from STATE->TEXT, write
+ * the text it came from and return 1; SKEL is the skeleton TREE would be
+ * put with. Return 0 if TREE needs to be put with LENS */
+static int put_clean(struct lens *lens, struct tree *tree,
+                     struct skel *skel, struct state *state) {
+    struct span *span = tree->span;
+    size_t start, end;
+
+    if (state->text == NULL || tree->dirty || span == NULL
+        || span->span_start == UINT_MAX
+        || span->span_end > state->text_len + state->text_nl)
+        return 0;
+
+    /* The text only fits here if it was parsed with this lens, which a
+     * node that was moved from elsewhere might not have been */
+    if (skel == NULL || ! skel_instance_of(lens->child, skel))
+        return 0;
+
+    start = span->span_start;
+    end = span->span_end;
+    if (start < state->text_len) {
+        size_t n = (end < state->text_len ? end : state->text_len) - start;
+        fwrite(state->text + start, 1, n, state->out);
+    }
+    if (end > state->text_len)
+        fputc('\n', state->out);
+    return 1;
+}
+
 /*
  * put
  */
@@ -438,10 +711,20 @@ static void put_subtree(struct lens *lens, struct state *state) {
     assert(lens->tag == L_SUBTREE);
     struct state oldstate = *state;
     struct split oldsplit = *state->split;
-    size_t oldpathlen = strlen(state->path);
+    size_t oldpathlen;
 
     struct tree *tree = state->split->tree;
     struct split *split = NULL;
+    struct skel *skel;
+    struct dict *dict;
+
+    /* Use up the entry for TREE even if we copy its text, so that the
+     * nodes after it with the same label still get their own skeletons */
+    dict_lookup(tree->label, state->dict, &skel, &dict);
+    if (put_clean(lens, tree, skel, state))
+        return;
+
+    oldpathlen = strlen(state->path);
 
     state->key = tree->label;
     state->value = tree->value;
@@ -450,7 +733,8 @@ static void put_subtree(struct lens *lens, struct state *state) {
     split = make_split(tree->children);
     set_split(state, split);
 
-    dict_lookup(tree->label, state->dict, &state->skel, &state->dict);
+    state->skel = skel;
+    state->dict = dict;
     if (state->skel == NULL || ! skel_instance_of(lens->child, state->skel)) {
         create_lens(lens->child, state);
     } else {
@@ -584,11 +868,9 @@ static void put_store(struct lens *lens, struct state *state) {
                   "Can not store a nonexistent (NULL) value");
     } else if (regexp_match(lens->regexp, state->value, strlen(state->value),
                             0, NULL) != strlen(state->value)) {
-        char *pat = regexp_escape(lens->regexp);
-        put_error(state, lens,
-                  "Value '%s' does not match regexp /%s/ in store lens",
-                  state->value, pat);
-        free(pat);
+        struct lns_error *err = make_put_error(state, lens, LNS_ERROR_STORE);
+        if (err != NULL)
+            err->text = strdup(state->value);
     } else {
         fprintf(state->out, "%s", state->value);
     }
@@ -835,7 +1117,46 @@ static void create_lens(struct lens *lens, struct state *state) {
 
 void lns_put(FILE *out, struct lens *lens, struct tree *tree,
              const char *text, struct lns_error **err) {
+    lns_put_n(out, lens, tree, text, strlen(text), 0, err);
+}
+
+/* Write TREE to OUT, with the formatting of the original text taken from
+ * its skeleton SKEL and dictionary DICT. DICT is used up in the process,
+ * but still needs to be freed by the caller. If TEXT is not NULL, it is
+ * the original text, of LEN bytes plus a newline if TEXT_NL, and nodes
+ * that are still clean are copied from it */
+static void put_text(FILE *out, struct lens *lens, struct tree *tree,
+                     struct skel *skel, struct dict *dict,
+                     const char *text, size_t len, int text_nl,
+                     struct lns_error **err) {
     struct state state;
+
+    MEMZERO(&state, 1);
+    state.path = strdup("");
+    state.out = out;
+    state.skel = skel;
+    state.dict = dict;
+    state.text = text;
+    state.text_len = len;
+    state.text_nl = text_nl;
+    state.split = make_split(tree);
+    state.key = tree->label;
+    put_lens(lens, &state);
+
+    free(state.path);
+    free_split(state.split);
+    if (err != NULL) {
+        *err = state.error;
+    } else {
+        free_lns_error(state.error);
+    }
+}
+
+void lns_put_n(FILE *out, struct lens *lens, struct tree *tree,
+               const char *text, size_t len, int add_newline,
+               struct lns_error **err) {
+    struct skel *skel;
+    struct dict *dict = NULL;
     struct lns_error *err1;
 
     if (err != NULL)
@@ -843,9 +1164,7 @@ void lns_put(FILE *out, struct lens *lens, struct tree *tree,
     if (tree == NULL)
         return;
 
-    MEMZERO(&state, 1);
-    state.path = strdup("");
-    state.skel = lns_parse(lens, text, &state.dict, &err1);
+    skel = lns_parse_n(lens, text, len, add_newline, &dict, &err1);
 
     if (err1 != NULL) {
         if (err != NULL)
@@ -854,20 +1173,78 @@ void lns_put(FILE *out, struct lens *lens, struct tree *tree,
             free_lns_error(err1);
         return;
     }
-    state.out = out;
-    state.split = make_split(tree);
-    state.key = tree->label;
-    put_lens(lens, &state);
+    put_text(out, lens, tree, skel, dict, NULL, 0, 0, err);
+    free_skel(skel);
+    free_dict(dict);
+}
 
+static void no_parse_error(struct lens *lens, struct lns_error **err) {
+    struct state state;
+
+    MEMZERO(&state, 1);
+    state.path = strdup("");
+    put_error(&state, lens, "no parse of the original text with this lens");
     free(state.path);
-    free_split(state.split);
-    free_skel(state.skel);
-    free_dict(state.dict);
-    if (err != NULL) {
+    if (err != NULL)
         *err = state.error;
-    } else {
+    else
         free_lns_error(state.error);
+}
+
+void lns_put_parse(FILE *out, struct lens *lens, struct tree *tree,
+                   struct lns_parse *parse, struct lns_error **err) {
+    if (err != NULL)
+        *err = NULL;
+    if (tree == NULL)
+        goto done;
+
+    if (parse == NULL || parse->lens != lens) {
+        no_parse_error(lens, err);
+        goto done;
+    }
+    put_text(out, lens, tree, parse->skel, parse->dict, NULL, 0, 0, err);
+ done:
+    free_lns_parse(parse);
+}
+
+void lns_put_spans(FILE *out, struct lens *lens, struct tree *tree,
+                   const char *text, size_t len, int add_newline,
+                   struct lns_parse *parse, struct lns_error **err) {
+    struct skel *skel = NULL;
+    struct dict *dict = NULL;
+    int text_nl = add_newline && (len == 0 || text[len - 1] != '\n');
+
+    if (err != NULL)
+        *err = NULL;
+    if (tree == NULL)
+        goto done;
+
+    if (parse != NULL) {
+        if (parse->lens != lens) {
+            no_parse_error(lens, err);
+            goto done;
+        }
+        skel = parse->skel;
+        dict = parse->dict;
+    } else {
+        struct lns_error *err1;
+
+        skel = lns_parse_n(lens, text, len, add_newline, &dict, &err1);
+        if (err1 != NULL) {
+            if (err != NULL)
+                *err = err1;
+            else
+                free_lns_error(err1);
+            goto done;
+        }
     }
+    put_text(out, lens, tree, skel, dict, text, len, text_nl, err);
+    if (parse == NULL) {
+        free_skel(skel);
+        free_dict(dict);
+    }
+ done:
+    free_lns_parse(parse);
 }
 
 /*
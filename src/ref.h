@@ -37,6 +37,8 @@
  * own the reference.
  */
 // FIXME: This is not threadsafe; incr/decr ref needs to be protected
+// Pinned objects are the exception, since REF and UNREF never write to
+// them. HERA_FREEZE pins all lenses for that reason
 
 #define REF_MAX UINT_MAX
 
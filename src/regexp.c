@@ -21,12 +21,14 @@
  */
 
 #include <config.h>
+#include <pthread.h>
 #include <regex.h>
 
 #include "internal.h"
 #include "syntax.h"
 #include "memory.h"
 #include "errcode.h"
+#include "hash.h"
 
 static const struct string empty_pattern_string = {
     .ref = REF_MAX, .str = (char *) "()"
@@ -185,16 +187,124 @@ struct regexp *make_regexp_from_glob(struct info *info, const char *glob) {
     return make_regexp(info, pat, 0);
 }
 
+/* Compiled regexps are shared by all regexps with the same pattern and
+ * case sensitivity, whichever lens, module or heracles handle they come
+ * from. PROGS_LOCK protects PROGS and the reference counts of the
+ * programs in it; the programs themselves can be used from several
+ * threads at once */
+/* glibc's regex engine locks a pattern buffer while it matches with it, so
+ * that threads can share compiled patterns. The replacement from gnulib,
+ * which config.h renames re_match to when it is used, does no such
+ * locking, and we have to lock each program ourselves */
+#ifdef re_match
+# define PROG_NEEDS_LOCK 1
+#endif
+
+struct regexp_prog {
+    unsigned int              ref;
+    char                     *pattern;
+    unsigned int              nocase : 1;
+    struct re_pattern_buffer  re;
+    /* Set up by the first match without registers, see REGEXP_MATCH,
+     * and by the first REGEXP_STEP */
+    struct fa_dfa            *dfa;
+    unsigned int              dfa_tried; /* Read without PROGS_LOCK */
+#ifdef PROG_NEEDS_LOCK
+    pthread_mutex_t           lock;     /* Held while RE is matched */
+#endif
+};
+
+static pthread_mutex_t progs_lock = PTHREAD_MUTEX_INITIALIZER;
+static hash_t *progs = NULL;
+
+static hash_val_t prog_hash(const void *key) {
+    const struct regexp_prog *prog = key;
+    hash_val_t h = 2166136261UL;
+
+    for (const char *p = prog->pattern; *p != '\0'; p++)
+        h = (h ^ (unsigned char) *p) * 16777619UL;
+    return h ^ prog->nocase;
+}
+
+static int prog_cmp(const void *key1, const void *key2) {
+    const struct regexp_prog *p1 = key1, *p2 = key2;
+
+    if (p1->nocase != p2->nocase)
+        return 1;
+    return strcmp(p1->pattern, p2->pattern);
+}
+
+static void free_prog(struct regexp_prog *prog) {
+    regfree(&prog->re);
+    fa_dfa_free(prog->dfa);
+#ifdef PROG_NEEDS_LOCK
+    pthread_mutex_destroy(&prog->lock);
+#endif
+    free(prog->pattern);
+    free(prog);
+}
+
+/* Run RE_MATCH with PROG's pattern buffer */
+static int prog_match(struct regexp_prog *prog, const char *string,
+                      int size, int start, struct re_registers *regs) {
+#ifdef PROG_NEEDS_LOCK
+    int count;
+
+    pthread_mutex_lock(&prog->lock);
+    count = re_match(&prog->re, string, size, start, regs);
+    pthread_mutex_unlock(&prog->lock);
+    return count;
+#else
+    return re_match(&prog->re, string, size, start, regs);
+#endif
+}
+
+/* Like PROG_MATCH, on the SIZE1 characters at STRING1 followed by the
+ * SIZE2 characters at STRING2. The regexp engine puts the two together in
+ * a buffer of its own for every call, so callers keep them short */
+static int prog_match_2(struct regexp_prog *prog,
+                        const char *string1, int size1,
+                        const char *string2, int size2,
+                        int start, struct re_registers *regs) {
+    int stop = size1 + size2;
+#ifdef PROG_NEEDS_LOCK
+    int count;
+
+    pthread_mutex_lock(&prog->lock);
+    count = re_match_2(&prog->re, string1, size1, string2, size2,
+                       start, regs, stop);
+    pthread_mutex_unlock(&prog->lock);
+    return count;
+#else
+    return re_match_2(&prog->re, string1, size1, string2, size2,
+                      start, regs, stop);
+#endif
+}
+
+static void release_prog(struct regexp_prog *prog) {
+    if (prog == NULL)
+        return;
+
+    pthread_mutex_lock(&progs_lock);
+    prog->ref -= 1;
+    if (prog->ref == 0) {
+        hash_delete_free(progs, hash_lookup(progs, prog));
+        free_prog(prog);
+        if (hash_isempty(progs)) {
+            hash_destroy(progs);
+            progs = NULL;
+        }
+    }
+    pthread_mutex_unlock(&progs_lock);
+}
+
 void free_regexp(struct regexp *regexp) {
     if (regexp == NULL)
         return;
     assert(regexp->ref == 0);
     unref(regexp->info, info);
     unref(regexp->pattern, string);
-    if (regexp->re != NULL) {
-        regfree(regexp->re);
-        free(regexp->re);
-    }
+    release_prog(regexp->prog);
     free(regexp);
 }
 
@@ -506,7 +616,66 @@ struct regexp *regexp_make_empty(struct info *info) {
     return regexp;
 }
 
-static int regexp_compile_internal(struct regexp *r, const char **c) {
+static pthread_once_t dfa_once = PTHREAD_ONCE_INIT;
+static bool dfa_enabled;
+
+static void dfa_init(void) {
+    dfa_enabled = getenv(HERACLES_DFA_ENV) != NULL;
+}
+
+static const char *skip_bracket(const char *p);
+
+/* Return true if libfa reads PAT the same way as the regexp engine.
+ * libfa takes anchors and character classes like [:alpha:] literally */
+static bool dfa_pattern(const char *pat) {
+    for (const char *p = pat; *p != '\0'; ) {
+        if (*p == '\\') {
+            p += (p[1] == '\0') ? 1 : 2;
+        } else if (*p == '[') {
+            const char *end = skip_bracket(p + 1);
+            for (const char *q = p + 1; q < end; q++)
+                if (*q == '[' && (q[1] == ':' || q[1] == '.' || q[1] == '='))
+                    return false;
+            p = end;
+        } else if (*p == '^' || *p == '$') {
+            return false;
+        } else {
+            p += 1;
+        }
+    }
+    return true;
+}
+
+/* Set up PROG->DFA. If we can't, we quietly use the regexp engine for
+ * everything. Must be called with PROGS_LOCK held */
+static void prog_make_dfa(struct regexp_prog *prog) {
+    struct fa *fa = NULL;
+    const char *p = prog->pattern;
+
+    if (dfa_pattern(p)) {
+        if (fa_compile(p, strlen(p), &fa) != REG_NOERROR
+            || (prog->nocase && fa_nocase(fa) < 0))
+            fa_free(fa);
+        else
+            prog->dfa = fa_dfa_make(fa);
+    }
+    /* PROG->DFA must be set before anybody sees DFA_TRIED */
+    __atomic_store_n(&prog->dfa_tried, 1, __ATOMIC_RELEASE);
+}
+
+/* Make sure we tried to set up PROG->DFA. Once we have, that only takes a
+ * look at PROG->DFA_TRIED, and matches do not contend for PROGS_LOCK */
+static void prog_need_dfa(struct regexp_prog *prog) {
+    if (__atomic_load_n(&prog->dfa_tried, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&progs_lock);
+    if (! prog->dfa_tried)
+        prog_make_dfa(prog);
+    pthread_mutex_unlock(&progs_lock);
+}
+
+/* Compile a new program for R. Must be called with PROGS_LOCK held */
+static struct regexp_prog *make_prog(struct regexp *r, const char **c) {
     /* See the GNU regex manual or regex.h in gnulib for
      * an explanation of these flags. They are set so that the regex
      * matcher interprets regular expressions the same way that libfa
@@ -517,23 +686,84 @@ static int regexp_compile_internal(struct regexp *r, const char **c) {
         |RE_INTERVALS|RE_NO_BK_BRACES|RE_NO_BK_PARENS|RE_NO_BK_REFS
         |RE_NO_BK_VBAR|RE_NO_EMPTY_RANGES
         |RE_NO_POSIX_BACKTRACKING|RE_CONTEXT_INVALID_DUP|RE_NO_GNU_OPS;
+    /* RE_COMPILE_PATTERN only takes the syntax from the global
+     * RE_SYNTAX_OPTIONS. PROGS_LOCK keeps our own threads from racing on
+     * it, but not other users of the regex library in the process; see
+     * hera_freeze in heracles.h */
     reg_syntax_t old_syntax = re_syntax_options;
+    struct regexp_prog *prog = NULL;
 
-    *c = NULL;
-
-    if (r->re == NULL)
-        CALLOC(r->re, 1);
+    if (ALLOC(prog) < 0 || (prog->pattern = strdup(r->pattern->str)) == NULL) {
+        free(prog);
+        *c = "Memory exhausted";
+        return NULL;
+    }
+    prog->nocase = r->nocase;
+#ifdef PROG_NEEDS_LOCK
+    pthread_mutex_init(&prog->lock, NULL);
+#endif
 
     re_syntax_options = syntax;
     if (r->nocase)
         re_syntax_options |= RE_ICASE;
-    *c = re_compile_pattern(r->pattern->str, strlen(r->pattern->str), r->re);
+    *c = re_compile_pattern(prog->pattern, strlen(prog->pattern), &prog->re);
     re_syntax_options = old_syntax;
 
-    r->re->regs_allocated = REGS_REALLOCATE;
-    if (*c != NULL)
-        return -1;
-    return 0;
+    if (*c != NULL) {
+        free_prog(prog);
+        return NULL;
+    }
+    prog->re.regs_allocated = REGS_REALLOCATE;
+    /* PROG->DFA is only set up once a match can use it, see REGEXP_MATCH */
+    pthread_once(&dfa_once, dfa_init);
+    return prog;
+}
+
+/* Use the program for R's pattern if we have one already, and compile
+ * it otherwise. Compiling is never done from get or put on a frozen lens,
+ * since LNS_FREEZE compiles everything upfront */
+static int regexp_compile_internal(struct regexp *r, const char **c) {
+    struct regexp_prog key, *prog = NULL;
+    hnode_t *node;
+
+    *c = NULL;
+    if (r->prog != NULL)
+        return 0;
+
+    key.pattern = r->pattern->str;
+    key.nocase = r->nocase;
+
+    pthread_mutex_lock(&progs_lock);
+    if (progs == NULL)
+        progs = hash_create(HASHCOUNT_T_MAX, prog_cmp, prog_hash);
+    if (progs == NULL) {
+        *c = "Memory exhausted";
+        goto done;
+    }
+    node = hash_lookup(progs, &key);
+    if (node != NULL) {
+        prog = hnode_get(node);
+        prog->ref += 1;
+        goto done;
+    }
+    prog = make_prog(r, c);
+    if (prog == NULL)
+        goto done;
+    if (hash_alloc_insert(progs, prog, prog) < 0) {
+        free_prog(prog);
+        prog = NULL;
+        *c = "Memory exhausted";
+        goto done;
+    }
+    prog->ref = 1;
+ done:
+    if (progs != NULL && hash_isempty(progs)) {
+        hash_destroy(progs);
+        progs = NULL;
+    }
+    pthread_mutex_unlock(&progs_lock);
+    r->prog = prog;
+    return (prog == NULL) ? -1 : 0;
 }
 
 int regexp_compile(struct regexp *r) {
@@ -549,28 +779,176 @@ int regexp_check(struct regexp *r, const char **msg) {
 int regexp_match(struct regexp *r,
                  const char *string, const int size,
                  const int start, struct re_registers *regs) {
-    if (r->re == NULL) {
+    if (r->prog == NULL) {
+        if (regexp_compile(r) == -1)
+            return -3;
+    }
+    /* The DFA finds the longest match just like the regexp engine. When
+     * we need registers, running it first only adds to the work the
+     * regexp engine does anyway; regexps that are only ever matched with
+     * registers therefore never pay for setting it up */
+    if (dfa_enabled && regs == NULL) {
+        prog_need_dfa(r->prog);
+        if (r->prog->dfa != NULL) {
+            int count = fa_dfa_match(r->prog->dfa, string + start,
+                                     size - start);
+            if (count != -2)
+                return count;
+        }
+    }
+    return prog_match(r->prog, string, size, start, regs);
+}
+
+/* Add OFS to the offsets in REGS, for a match that started OFS characters
+ * into the string the caller passed */
+static void shift_regs(struct re_registers *regs, int ofs) {
+    if (regs == NULL || ofs == 0)
+        return;
+    for (unsigned i=0; i < regs->num_regs; i++) {
+        if (regs->start[i] >= 0) {
+            regs->start[i] += ofs;
+            regs->end[i] += ofs;
+        }
+    }
+}
+
+int regexp_match_2(struct regexp *r,
+                   const char *string1, const int size1,
+                   const char *string2, const int size2,
+                   const int start, struct re_registers *regs) {
+    struct regexp_prog *prog;
+    size_t len;
+    int count, ret;
+
+    if (size2 == 0)
+        return regexp_match(r, string1, size1, start, regs);
+    if (start >= size1) {
+        count = regexp_match(r, string2, size2, start - size1, regs);
+        if (count >= 0)
+            shift_regs(regs, size1);
+        return count;
+    }
+    if (r->prog == NULL) {
         if (regexp_compile(r) == -1)
             return -3;
     }
-    return re_match(r->re, string, size, start, regs);
+    prog = r->prog;
+
+    /* Find the extent of the match on the DFA, which reads the two strings
+     * one after the other, so that the regexp engine, if it has to fill
+     * in REGS, only sees the characters that were matched. The patterns
+     * we have a DFA for have no anchors, so cutting the text off right
+     * after the match does not change the registers. Without the DFA, the
+     * regexp engine would have to copy all of both strings on every call,
+     * which the caller can do once for all of its matches */
+    prog_need_dfa(prog);
+    if (prog->dfa == NULL)
+        return -4;
+    ret = fa_dfa_prefix(prog->dfa, string1 + start, size1 - start,
+                        string2, size2, &len);
+    if (ret == -2)
+        return -4;
+    if (ret == -1 || regs == NULL)
+        return (ret == -1) ? -1 : (int) len;
+    if (start + len <= size1)
+        return prog_match(prog, string1, start + len, start, regs);
+    count = prog_match_2(prog, string1 + start, size1 - start,
+                         string2, start + len - size1, 0, regs);
+    if (count >= 0)
+        shift_regs(regs, start);
+    return count;
+}
+
+int regexp_step(struct regexp *r, int state,
+                const char *const *pieces, size_t npieces, int *accept) {
+    struct regexp_prog *prog;
+
+    if (r->prog == NULL) {
+        if (regexp_compile(r) == -1)
+            return -2;
+    }
+    prog = r->prog;
+    /* Once a match has left the initial state, we have seen PROG->DFA
+     * already */
+    if (state == 0)
+        prog_need_dfa(prog);
+    if (prog->dfa == NULL)
+        return -2;
+    return fa_dfa_run(prog->dfa, state, pieces, npieces, accept);
+}
+
+int regexp_prefix(struct regexp *r, const char *text, size_t len,
+                  const char *tail, size_t *count) {
+    struct regexp_prog *prog;
+    int result;
+
+    *count = 0;
+    if (r->prog == NULL) {
+        if (regexp_compile(r) == -1)
+            return -2;
+    }
+    prog = r->prog;
+    prog_need_dfa(prog);
+    if (prog->dfa == NULL)
+        return -3;
+    result = fa_dfa_prefix(prog->dfa, text, len, tail, strlen(tail), count);
+    return (result == -2) ? -3 : result;
 }
 
 int regexp_matches_empty(struct regexp *r) {
     return regexp_match(r, "", 0, 0, NULL) == 0;
 }
 
+/* Skip over the bracket expression starting at P, which points just past
+ * the opening '['. Backslash is not special in a bracket expression, and a
+ * ']' right at the start is an ordinary character */
+static const char *skip_bracket(const char *p) {
+    if (*p == '^')
+        p += 1;
+    if (*p == ']')
+        p += 1;
+    while (*p != '\0' && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char delim = p[1];
+            p += 2;
+            while (*p != '\0' && !(p[0] == delim && p[1] == ']'))
+                p += 1;
+            if (*p != '\0')
+                p += 2;
+        } else {
+            p += 1;
+        }
+    }
+    return (*p == ']') ? p + 1 : p;
+}
+
+/* Count the groups in R's pattern rather than compiling it: the get and
+ * put walkers need the number of groups in each child's type, but only
+ * ever match against the type of the parent */
 int regexp_nsub(struct regexp *r) {
-    if (r->re == NULL)
-        if (regexp_compile(r) == -1)
-            return -1;
-    return r->re->re_nsub;
+    int nsub = 0;
+
+    if (r->prog != NULL)
+        return r->prog->re.re_nsub;
+
+    for (const char *p = r->pattern->str; *p != '\0'; ) {
+        if (*p == '\\') {
+            p += (p[1] == '\0') ? 1 : 2;
+        } else if (*p == '[') {
+            p = skip_bracket(p + 1);
+        } else {
+            if (*p == '(')
+                nsub += 1;
+            p += 1;
+        }
+    }
+    return nsub;
 }
 
 void regexp_release(struct regexp *regexp) {
-    if (regexp != NULL && regexp->re != NULL) {
-        regfree(regexp->re);
-        FREE(regexp->re);
+    if (regexp != NULL) {
+        release_prog(regexp->prog);
+        regexp->prog = NULL;
     }
 }
 
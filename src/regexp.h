@@ -26,11 +26,13 @@
 #include <stdio.h>
 #include <regex.h>
 
+struct regexp_prog;
+
 struct regexp {
     unsigned int              ref;
     struct info              *info;
     struct string            *pattern;
-    struct re_pattern_buffer *re;
+    struct regexp_prog       *prog;  /* Compiled form, see regexp.c */
     unsigned int              nocase : 1;
 };
 
@@ -62,8 +64,10 @@ struct regexp *make_regexp_from_glob(struct info *info, const char *glob);
 /* Do not call directly, use UNREF instead */
 void free_regexp(struct regexp *regexp);
 
-/* Compile R->PATTERN into R->RE; return -1 and print an error
- * if compilation fails. Return 0 otherwise
+/* Compile R->PATTERN into R->PROG; return -1 and print an error
+ * if compilation fails. Return 0 otherwise. All regexps with the same
+ * pattern and case sensitivity share one compiled program, so this only
+ * compiles the first of them
  */
 int regexp_compile(struct regexp *r);
 
@@ -73,17 +77,54 @@ int regexp_compile(struct regexp *r);
  */
 int regexp_check(struct regexp *r, const char **msg);
 
-/* Call RE_MATCH on R->RE and return its result; if R hasn't been compiled
+/* Call RE_MATCH on R's program and return its result; if R hasn't been compiled
  * yet, compile it. Return -3 if compilation fails
  */
 int regexp_match(struct regexp *r, const char *string, const int size,
                  const int start, struct re_registers *regs);
 
+/* Like REGEXP_MATCH, on the SIZE1 characters at STRING1 followed by the
+ * SIZE2 characters at STRING2, without putting the two together in one
+ * string first. START and the offsets in REGS count from STRING1.
+ *
+ * Return -4 if the match reaches into STRING2 and R has no DFA, or the DFA
+ * gives up; the regexp engine would then have to copy both strings on
+ * every call. The caller has to use REGEXP_MATCH on one string that holds
+ * both instead, which it can build once for all of its matches.
+ */
+int regexp_match_2(struct regexp *r,
+                   const char *string1, const int size1,
+                   const char *string2, const int size2,
+                   const int start, struct re_registers *regs);
+
+/* Match R against a text that is handed over in pieces, without ever
+ * putting it together in one string. Start with STATE 0 and pass what one
+ * call returns as the STATE of the next; each call reads the NPIECES
+ * strings in PIECES. Return the new state and set *ACCEPT to 1 if R
+ * matches all the text read so far, to 0 otherwise. Return -1 if nothing
+ * that starts with that text can match R, and -2 if we can't tell; the
+ * caller then has to use REGEXP_MATCH on the whole text.
+ */
+int regexp_step(struct regexp *r, int state,
+                const char *const *pieces, size_t npieces, int *accept);
+
+/* Set *COUNT to the length of the longest prefix of the LEN characters at
+ * TEXT, followed by the NUL-terminated string TAIL, that R matches. The
+ * match runs on R's DFA.
+ *
+ * Return 0 if there is such a prefix, -1 if there is none, and -2 on
+ * error. Return -3 if R has no DFA, or the DFA gives up; REGEXP_MATCH
+ * on one string that holds TEXT and TAIL finds the same prefix.
+ */
+int regexp_prefix(struct regexp *r, const char *text, size_t len,
+                  const char *tail, size_t *count);
+
 /* Return 1 if R matches the empty string, 0 otherwise */
 int regexp_matches_empty(struct regexp *r);
 
-/* Return the number of subexpressions (parentheses) inside R. May cause
- * compilation of R; return -1 if compilation fails.
+/* Return the number of subexpressions (parentheses) inside R. This never
+ * compiles R; if R has not been compiled, the groups are counted in its
+ * pattern.
  */
 int regexp_nsub(struct regexp *r);
 
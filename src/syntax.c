@@ -37,13 +37,15 @@
 #include "heracles.h"
 #include "transform.h"
 #include "errcode.h"
+#include "hash.h"
+#include "cache.h"
 
 /* Extension of source files */
 #define HERA_EXT ".aug"
 
 #define LNS_TYPE_CHECK(ctx) ((ctx)->hera->flags & HERA_TYPE_CHECK)
 
-static const char *const builtin_module = "Builtin";
+const char *const builtin_module = "Builtin";
 
 static const struct type string_type    = { .ref = UINT_MAX, .tag = T_STRING };
 static const struct type regexp_type    = { .ref = UINT_MAX, .tag = T_REGEXP };
@@ -79,6 +81,8 @@ struct ctx {
     const char     *name;     /* The module we are working on */
     struct heracles  *hera;
     struct binding *local;
+    struct module  *module;   /* The module being compiled; NULL while
+                                 typechecking */
 };
 
 static int init_fatal_exn(struct error *error) {
@@ -151,7 +155,7 @@ void fatal_error(struct info *info, const char *format, ...) {
     va_end(ap);
 }
 
-static void free_param(struct param *param) {
+void free_param(struct param *param) {
     if (param == NULL)
         return;
     assert(param->ref == 0);
@@ -214,7 +218,7 @@ void free_term(struct term *term) {
     free(term);
 }
 
-static void free_binding(struct binding *binding) {
+void free_binding(struct binding *binding) {
     if (binding == NULL)
         return;
     assert(binding->ref == 0);
@@ -225,11 +229,21 @@ static void free_binding(struct binding *binding) {
     free(binding);
 }
 
+static void bndindex_free(struct module *module) {
+    if (module->bndindex != NULL) {
+        hash_free_nodes(module->bndindex);
+        hash_destroy(module->bndindex);
+        module->bndindex = NULL;
+    }
+}
+
 void free_module(struct module *module) {
     if (module == NULL)
         return;
     assert(module->ref == 0);
     free(module->name);
+    free(module->depz);
+    bndindex_free(module);
     unref(module->next, module);
     unref(module->bindings, binding);
     unref(module->autoload, transform);
@@ -461,7 +475,7 @@ struct module *module_create(const char *name) {
     return module;
 }
 
-static struct module *module_find(struct module *module, const char *name) {
+struct module *module_find(struct module *module, const char *name) {
     list_for_each(e, module) {
         if (STRCASEEQ(e->name, name))
             return e;
@@ -469,6 +483,54 @@ static struct module *module_find(struct module *module, const char *name) {
     return NULL;
 }
 
+/* Module names are compared case-insensitively, so the hash has to fold
+ * case, too */
+static hash_val_t modtable_hash(const void *key) {
+    hash_val_t h = 2166136261UL;
+    for (const char *s = key; *s != '\0'; s++) {
+        h ^= tolower((unsigned char) *s);
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static int modtable_compare(const void *key1, const void *key2) {
+    return strcasecmp(key1, key2);
+}
+
+struct module *module_lookup(struct heracles *hera, const char *name) {
+    if (hera->modtable == NULL)
+        return module_find(hera->modules, name);
+
+    hnode_t *node = hash_lookup(hera->modtable, name);
+    return node == NULL ? NULL : hnode_get(node);
+}
+
+static void modtable_free(struct heracles *hera) {
+    if (hera->modtable != NULL) {
+        hash_free_nodes(hera->modtable);
+        hash_destroy(hera->modtable);
+        hera->modtable = NULL;
+    }
+}
+
+/* Add the list MODULES to the modules loaded into HERA. If a module with
+ * the same name is already loaded, the new one is appended, but lookups
+ * keep finding the earlier one, just as with a linear search of
+ * HERA->MODULES. If we run out of memory, we drop the table and go back to
+ * searching the list */
+static void module_register(struct heracles *hera, struct module *modules) {
+    list_append(hera->modules, modules);
+    list_for_each(m, modules) {
+        if (hera->modtable == NULL)
+            return;
+        if (hash_lookup(hera->modtable, m->name) != NULL)
+            continue;
+        if (hash_alloc_insert(hera->modtable, m->name, m) < 0)
+            modtable_free(hera);
+    }
+}
+
 static struct binding *bnd_lookup(struct binding *bindings, const char *name) {
     list_for_each(b, bindings) {
         if (STREQ(b->ident->str, name))
@@ -477,6 +539,39 @@ static struct binding *bnd_lookup(struct binding *bindings, const char *name) {
     return NULL;
 }
 
+/* Index the bindings of MODULE by name. Earlier bindings in the list
+ * shadow later ones with the same name, and the index only records the
+ * first one */
+static int bndindex_build(struct module *module) {
+    if (module->bndindex != NULL)
+        return 0;
+
+    module->bndindex = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    if (module->bndindex == NULL)
+        return -1;
+    list_for_each(b, module->bindings) {
+        if (hash_lookup(module->bndindex, b->ident->str) != NULL)
+            continue;
+        if (hash_alloc_insert(module->bndindex, b->ident->str, b) < 0) {
+            bndindex_free(module);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Look NAME up among the bindings of MODULE. The bindings of a loaded
+ * module do not change anymore, so we index them the first time we get
+ * here */
+static struct binding *module_bnd_lookup(struct module *module,
+                                         const char *name) {
+    if (bndindex_build(module) < 0)
+        return bnd_lookup(module->bindings, name);
+
+    hnode_t *node = hash_lookup(module->bndindex, name);
+    return node == NULL ? NULL : hnode_get(node);
+}
+
 static char *modname_of_qname(const char *qname) {
     char *dot = strchr(qname, '.');
     if (dot == NULL)
@@ -485,30 +580,65 @@ static char *modname_of_qname(const char *qname) {
     return strndup(qname, dot - qname);
 }
 
+static bool module_has_dep(struct module *m, const char *name) {
+    const char *d = NULL;
+    while ((d = argz_next(m->depz, m->ndepz, d)) != NULL) {
+        if (STREQ(d, name))
+            return true;
+    }
+    return false;
+}
+
+/* Record that the values of module M were built from those of DEP, and
+ * therefore from everything DEP itself was built from */
+static int module_add_dep(struct module *m, struct module *dep) {
+    const char *d = NULL;
+    int r;
+
+    if (STREQ(dep->name, builtin_module) || STREQ(dep->name, m->name))
+        return 0;
+    if (module_has_dep(m, dep->name))
+        return 0;
+    r = argz_add(&m->depz, &m->ndepz, dep->name);
+    if (r != 0)
+        return -1;
+    while ((d = argz_next(dep->depz, dep->ndepz, d)) != NULL) {
+        if (STREQ(d, m->name) || module_has_dep(m, d))
+            continue;
+        r = argz_add(&m->depz, &m->ndepz, d);
+        if (r != 0)
+            return -1;
+    }
+    return 0;
+}
+
 static int lookup_internal(struct heracles *hera, const char *ctx_modname,
+                           struct module *dependent,
                            const char *name, struct binding **bnd) {
     char *modname = modname_of_qname(name);
 
     *bnd = NULL;
 
     if (modname == NULL) {
-        struct module *builtin =
-            module_find(hera->modules, builtin_module);
+        struct module *builtin = module_lookup(hera, builtin_module);
         assert(builtin != NULL);
-        *bnd = bnd_lookup(builtin->bindings, name);
+        *bnd = module_bnd_lookup(builtin, name);
         return 0;
     }
 
- qual_lookup:
-    list_for_each(module, hera->modules) {
-        if (STRCASEEQ(module->name, modname)) {
-            *bnd = bnd_lookup(module->bindings, name + strlen(modname) + 1);
-            free(modname);
-            return 0;
-        }
+ qual_lookup:;
+    struct module *module = module_lookup(hera, modname);
+    if (module != NULL) {
+        *bnd = module_bnd_lookup(module, name + strlen(modname) + 1);
+        free(modname);
+        if (dependent != NULL && *bnd != NULL
+            && module_add_dep(dependent, module) < 0)
+            return -1;
+        return 0;
     }
-    /* Try to load the module */
-    if (streqv(modname, ctx_modname)) {
+    /* Try to load the module; once HERA is frozen, the set of modules
+     * can't change anymore */
+    if (streqv(modname, ctx_modname) || hera->frozen != NULL) {
         free(modname);
         return 0;
     }
@@ -523,7 +653,7 @@ static int lookup_internal(struct heracles *hera, const char *ctx_modname,
 struct lens *lens_lookup(struct heracles *hera, const char *qname) {
     struct binding *bnd = NULL;
 
-    if (lookup_internal(hera, NULL, qname, &bnd) < 0)
+    if (lookup_internal(hera, NULL, NULL, qname, &bnd) < 0)
         return NULL;
     if (bnd == NULL || bnd->value->tag != V_LENS)
         return NULL;
@@ -544,7 +674,7 @@ static struct binding *ctx_lookup_bnd(struct info *info,
 
     if (ctx->hera != NULL) {
         int r;
-        r = lookup_internal(ctx->hera, ctx->name, name, &b);
+        r = lookup_internal(ctx->hera, ctx->name, ctx->module, name, &b);
         if (r == 0)
             return b;
         char *modname = modname_of_qname(name);
@@ -1364,6 +1494,7 @@ static int typecheck(struct term *term, struct heracles *hera) {
     ctx.hera = hera;
     ctx.local = NULL;
     ctx.name = term->mname;
+    ctx.module = NULL;
     list_for_each(dcl, term->decls) {
         ok &= check_decl(dcl, &ctx);
     }
@@ -1579,6 +1710,7 @@ static struct value *apply(struct term *app, struct ctx *ctx) {
     lctx.hera = ctx->hera;
     lctx.local = ref(f->bindings);
     lctx.name = ctx->name;
+    lctx.module = ctx->module;
 
     arg = coerce(arg, f->func->param->type);
     if (arg == NULL)
@@ -1793,6 +1925,9 @@ static struct module *compile(struct term *term, struct heracles *hera) {
     ctx.hera = hera;
     ctx.local = NULL;
     ctx.name = term->mname;
+    /* Created up front so that lookups can record what it depends on */
+    ctx.module = module_create(term->mname);
+    ERR_NOMEM(ctx.module == NULL || ctx.module->name == NULL, hera);
     list_for_each(dcl, term->decls) {
         if (!compile_decl(dcl, &ctx))
             goto error;
@@ -1809,12 +1944,12 @@ static struct module *compile(struct term *term, struct heracles *hera) {
             goto error;
         autoload = bnd->value->transform;
     }
-    struct module *module = module_create(term->mname);
-    module->bindings = ctx.local;
-    module->autoload = ref(autoload);
-    return module;
+    ctx.module->bindings = ctx.local;
+    ctx.module->autoload = ref(autoload);
+    return ctx.module;
  error:
     unref(ctx.local, binding);
+    unref(ctx.module, module);
     return NULL;
 }
 
@@ -1901,6 +2036,7 @@ int define_native_intl(const char *file, int line,
     ctx.hera = NULL;
     ctx.local = ref(module->bindings);
     ctx.name = module->name;
+    ctx.module = NULL;
     if (! check_exp(func, &ctx)) {
         fatal_error(info, "Typechecking native %s failed",
                     name);
@@ -1917,6 +2053,7 @@ int define_native_intl(const char *file, int line,
     unref(module->bindings, binding);
 
     module->bindings = ctx.local;
+    bndindex_free(module);
     return 0;
  error:
     unref(v, value);
@@ -1939,11 +2076,28 @@ static char *module_basename(const char *modname) {
     return fname;
 }
 
-static char *module_filename(struct heracles *hera, const char *modname) {
+char *module_filename(struct heracles *hera, const char *modname) {
     char *dir = NULL;
     char *filename = NULL;
     char *name = module_basename(modname);
 
+    if (name == NULL)
+        return NULL;
+
+    /* The index is a snapshot of the load path taken in HERA_INIT; a file
+     * that was added to an earlier directory since then does not shadow the
+     * indexed one */
+    if (hera->modindex != NULL) {
+        hnode_t *node = hash_lookup(hera->modindex, name);
+        struct stat st;
+        if (node != NULL && stat(hnode_get(node), &st) == 0) {
+            filename = strdup(hnode_get(node));
+            goto done;
+        }
+    }
+
+    /* Not in the index, either because we never built one or because the
+     * file appeared or went away after HERA_INIT */
     while ((dir = argz_next(hera->modpathz, hera->nmodpath, dir)) != NULL) {
         int len = strlen(name) + strlen(dir) + 2;
         struct stat st;
@@ -1979,7 +2133,8 @@ int load_module_file(struct heracles *hera, const char *filename) {
     ERR_THROW(module == NULL, hera, HERA_ESYNTAX,
               "Failed to load %s", filename);
 
-    list_append(hera->modules, module);
+    module_register(hera, module);
+    cache_store(hera, filename, module);
     result = 0;
  error:
     // FIXME: This leads to a bad free of a string used in a del lens
@@ -1991,14 +2146,20 @@ int load_module_file(struct heracles *hera, const char *filename) {
 static int load_module(struct heracles *hera, const char *name) {
     char *filename = NULL;
 
-    if (module_find(hera->modules, name) != NULL)
+    if (module_lookup(hera, name) != NULL)
         return 0;
 
     if ((filename = module_filename(hera, name)) == NULL)
         return -1;
 
-    if (load_module_file(hera, filename) == -1)
+    struct module *module = cache_load(hera, filename);
+    if (module != NULL) {
+        if (hera->flags & HERA_TRACE_MODULE_LOADING)
+            printf("Module %s loaded from cache\n", filename);
+        module_register(hera, module);
+    } else if (load_module_file(hera, filename) == -1) {
         goto error;
+    }
 
     free(filename);
     return 0;
@@ -2008,6 +2169,82 @@ static int load_module(struct heracles *hera, const char *name) {
     return -1;
 }
 
+static void modindex_node_free(hnode_t *node,
+                               ATTRIBUTE_UNUSED void *ctx) {
+    free((void *) hnode_getkey(node));
+    free(hnode_get(node));
+    free(node);
+}
+
+/* Record PATH under its file name in HERA->MODINDEX. Since the load path
+ * is searched in order, the first file with a given name wins, just as it
+ * does in MODULE_FILENAME */
+static int modindex_add(struct heracles *hera, const char *path) {
+    const char *p = strrchr(path, SEP);
+    char *key = NULL, *val = NULL;
+
+    p = (p == NULL) ? path : p + 1;
+    if (hash_lookup(hera->modindex, p) != NULL)
+        return 0;
+
+    key = strdup(p);
+    val = strdup(path);
+    if (key == NULL || val == NULL)
+        goto error;
+    if (hash_alloc_insert(hera->modindex, key, val) < 0)
+        goto error;
+    return 0;
+ error:
+    free(key);
+    free(val);
+    return -1;
+}
+
+int interpreter_freeze(struct heracles *hera) {
+    int r;
+
+    if (hera->frozen != NULL)
+        return 0;
+
+    r = ALLOC(hera->frozen);
+    ERR_NOMEM(r < 0, hera);
+
+    list_for_each(module, hera->modules) {
+        r = bndindex_build(module);
+        ERR_NOMEM(r < 0, hera);
+        list_for_each(b, module->bindings) {
+            if (b->value == NULL || b->value->tag != V_LENS)
+                continue;
+            if (lns_freeze(b->value->lens, hera->frozen) < 0)
+                goto error;
+        }
+        if (module->autoload != NULL
+            && lns_freeze(module->autoload->lens, hera->frozen) < 0)
+            goto error;
+    }
+    return 0;
+ error:
+    if (hera->frozen != NULL) {
+        lns_thaw(hera->frozen);
+        FREE(hera->frozen);
+    }
+    return -1;
+}
+
+void interpreter_close(struct heracles *hera) {
+    if (hera->frozen != NULL) {
+        lns_thaw(hera->frozen);
+        FREE(hera->frozen);
+    }
+    cache_close(hera);
+    modtable_free(hera);
+    if (hera->modindex != NULL) {
+        hash_free_nodes(hera->modindex);
+        hash_destroy(hera->modindex);
+        hera->modindex = NULL;
+    }
+}
+
 int interpreter_init(struct heracles *hera) {
     int r;
 
@@ -2015,17 +2252,28 @@ int interpreter_init(struct heracles *hera) {
     if (r < 0)
         return -1;
 
-    hera->modules = builtin_init(hera->error);
+    /* If we can't get a table, lookups search the list of modules */
+    hera->modtable = hash_create(HASHCOUNT_T_MAX,
+                                 modtable_compare, modtable_hash);
+    module_register(hera, builtin_init(hera->error));
+    r = cache_init(hera);
+    if (r < 0)
+        return -1;
     if (hera->flags & HERA_NO_MODL_AUTOLOAD)
         return 0;
 
-    // For now, we just load every file on the search path
+    /* Index every file on the search path; unless HERA_LAZY_LOAD is set,
+     * we also load all of them right away */
     const char *dir = NULL;
     glob_t globbuf;
     int gl_flags = GLOB_NOSORT;
 
     MEMZERO(&globbuf, 1);
 
+    hera->modindex = hash_create(HASHCOUNT_T_MAX, NULL, NULL);
+    ERR_NOMEM(hera->modindex == NULL, hera);
+    hash_set_allocator(hera->modindex, NULL, modindex_node_free, NULL);
+
     while ((dir = argz_next(hera->modpathz, hera->nmodpath, dir)) != NULL) {
         char *globpat;
         r = asprintf(&globpat, "%s/*.aug", dir);
@@ -2045,6 +2293,14 @@ int interpreter_init(struct heracles *hera) {
         free(globpat);
     }
 
+    for (int i=0; i < globbuf.gl_pathc; i++) {
+        r = modindex_add(hera, globbuf.gl_pathv[i]);
+        ERR_NOMEM(r < 0, hera);
+    }
+
+    if (hera->flags & HERA_LAZY_LOAD)
+        goto done;
+
     for (int i=0; i < globbuf.gl_pathc; i++) {
         char *name, *p, *q;
         p = strrchr(globbuf.gl_pathv[i], SEP);
@@ -2059,6 +2315,7 @@ int interpreter_init(struct heracles *hera) {
             goto error;
         free(name);
     }
+ done:
     globfree(&globbuf);
     return 0;
  error:
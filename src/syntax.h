@@ -210,6 +210,11 @@ struct module {
     struct transform  *autoload;
     char              *name;
     struct binding    *bindings;
+    size_t             ndepz;
+    char              *depz;     /* The modules whose values went into
+                                    this one, as a glibc argz vector */
+    struct hash_t     *bndindex; /* BINDINGS indexed by name, built on
+                                    the first qualified lookup */
 };
 
 struct type *make_arrow_type(struct type *dom, struct type *img);
@@ -254,6 +259,8 @@ void exn_printf_line(struct value *exn, const char *format, ...)
 /* Do not call these directly, use UNREF instead */
 void free_value(struct value *v);
 void free_module(struct module *module);
+void free_binding(struct binding *binding);
+void free_param(struct param *param);
 
 /* Turn a list of PARAMS (represented as terms tagged as A_FUNC with the
  * param in PARAM) into nested A_FUNC terms
@@ -261,6 +268,18 @@ void free_module(struct module *module);
 struct term *build_func(struct term *params, struct term *exp);
 
 struct module *module_create(const char *name);
+struct module *module_find(struct module *module, const char *name);
+/* Find the module NAME among the modules loaded into HERA; like
+ * MODULE_FIND on HERA->MODULES, but through a hash table */
+struct module *module_lookup(struct heracles *hera, const char *name);
+
+/* The name of the module holding the builtin natives */
+extern const char *const builtin_module;
+
+/* Return the full path of the file on the load path that holds MODNAME,
+ * or NULL if there is none. Caller must free the result.
+ */
+char *module_filename(struct heracles *hera, const char *modname);
 
 #define define_native(error, module, name, argc, impl, types ...)       \
     define_native_intl(__FILE__, __LINE__, error, module, name,         \
@@ -280,6 +299,10 @@ int load_module_file(struct heracles *hera, const char *filename);
 #define LNS_CHECK_REC_NAME "lns_check_rec"
 
 int interpreter_init(struct heracles *hera);
+void interpreter_close(struct heracles *hera);
+/* Prepare the lenses of all loaded modules for concurrent use with
+ * LNS_FREEZE. Afterwards, no more modules are loaded into HERA */
+int interpreter_freeze(struct heracles *hera);
 
 struct lens *lens_lookup(struct heracles *hera, const char *qname);
 #endif
@@ -69,6 +69,35 @@ void free_filter(struct filter *f) {
     free(f);
 }
 
+/* Match GLOB against PATH. A glob without a '/' in front, like "*~" in
+ * an excl, only has to match the file name */
+static int glob_matches(const char *glob, const char *path) {
+    if (glob[0] != SEP) {
+        const char *name = strrchr(path, SEP);
+        if (name != NULL)
+            path = name + 1;
+    }
+    return fnmatch(glob, path, fnm_flags) == 0;
+}
+
+int filter_matches(struct filter *filter, const char *path) {
+    int found = 0;
+
+    list_for_each(f, filter) {
+        if (f->include && glob_matches(f->glob->str, path)) {
+            found = 1;
+            break;
+        }
+    }
+    if (! found)
+        return 0;
+    list_for_each(f, filter) {
+        if (! f->include && glob_matches(f->glob->str, path))
+            return 0;
+    }
+    return 1;
+}
+
 /*
  * Transformers
  */
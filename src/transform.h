@@ -37,6 +37,10 @@ struct filter {
 struct filter *make_filter(struct string *glb, unsigned int include);
 void free_filter(struct filter *filter);
 
+/* Return 1 if one of the incl globs in FILTER matches the file PATH and
+ * none of its excl globs does, and 0 otherwise */
+int filter_matches(struct filter *filter, const char *path);
+
 /* Transformers that actually run lenses on contents of files */
 struct transform {
     unsigned int      ref;
@@ -9,9 +9,11 @@
 #include "labels.h"
 
 #include <fnmatch.h>
+#include <limits.h>
 #include <argz.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 
 
@@ -32,12 +34,15 @@ int find_one_node(struct pathx *p, struct tree **match) {
     return -1;
 }
 
+/* The toplevel nodes of a tree from get have no parent, unlike those
+ * hanging off the origin */
 void tree_mark_dirty(struct tree *tree) {
     do {
         tree->dirty = 1;
         tree = tree->parent;
-    } while (tree != tree->parent && !tree->dirty);
-    tree->dirty = 1;
+    } while (tree != NULL && tree != tree->parent && !tree->dirty);
+    if (tree != NULL)
+        tree->dirty = 1;
 }
 
 void tree_clean(struct tree *tree) {
@@ -52,8 +57,11 @@ struct tree *tree_child(struct tree *tree, const char *label) {
     if (tree == NULL)
         return NULL;
 
+    /* When LABEL is the interned copy a child uses, like those of trees
+     * in an arena, that child is found without comparing strings; every
+     * other child is still compared with STREQV */
     list_for_each(child, tree->children) {
-        if (streqv(label, child->label))
+        if (label == child->label || streqv(label, child->label))
             return child;
     }
     return NULL;
@@ -130,10 +138,15 @@ void tree_store_value(struct tree *tree, char **value) {
         return;
     }
     if (tree->value != NULL) {
-        free(tree->value);
+        if (tree->arena == NULL)
+            free(tree->value);
         tree->value = NULL;
     }
     if (*value != NULL) {
+        /* Should the arena fail to take the string, it is leaked rather
+         * than freed while the tree still uses it */
+        if (tree->arena != NULL)
+            tree_arena_adopt(tree->arena, *value);
         tree->value = *value;
         *value = NULL;
     }
@@ -145,6 +158,8 @@ int tree_set_value(struct tree *tree, const char *value) {
 
     if (streqv(tree->value, value))
         return 0;
+    if (tree->arena != NULL && tree_arena_reserve(tree->arena, 1) < 0)
+        return -1;
     if (value != NULL) {
         v = strdup(value);
         if (v == NULL)
@@ -312,12 +327,8 @@ int tree_insert(struct pathx *p, const char *label, int before) {
     return -1;
 }
 
-struct tree *make_tree(char *label, char *value, struct tree *parent,
-                       struct tree *children) {
-    struct tree *tree;
-    if (ALLOC(tree) < 0)
-        return NULL;
-
+static void init_tree(struct tree *tree, char *label, char *value,
+                      struct tree *parent, struct tree *children) {
     tree->label = label;
     tree->value = value;
     tree->parent = parent;
@@ -329,6 +340,48 @@ struct tree *make_tree(char *label, char *value, struct tree *parent,
         tree_mark_dirty(tree);
     else
         tree->dirty = 1;
+}
+
+struct tree *make_tree(char *label, char *value, struct tree *parent,
+                       struct tree *children) {
+    struct tree_arena *arena = (parent == NULL) ? NULL : parent->arena;
+    char *ilabel = label;
+    struct tree *tree;
+
+    /* A node added to a tree from an arena is handed to the arena, so
+     * that it is released together with the rest of the tree. Its label
+     * is replaced by the arena's interned copy */
+    if (arena != NULL) {
+        if (label != NULL) {
+            ilabel = tree_arena_intern(arena, label, strlen(label));
+            if (ilabel == NULL)
+                return NULL;
+        }
+        if (tree_arena_reserve(arena, 2) < 0)
+            return NULL;
+    }
+    if (ALLOC(tree) < 0)
+        return NULL;
+
+    init_tree(tree, ilabel, value, parent, children);
+    if (arena != NULL) {
+        tree->arena = arena;
+        tree_arena_adopt(arena, tree);
+        tree_arena_adopt(arena, value);
+        free(label);
+    }
+    return tree;
+}
+
+struct tree *make_arena_tree(struct tree_arena *arena, char *label,
+                             char *value, struct tree *children) {
+    struct tree *tree = tree_arena_alloc(arena, sizeof(*tree));
+    if (tree == NULL)
+        return NULL;
+
+    MEMZERO(tree, 1);
+    init_tree(tree, label, value, NULL, children);
+    tree->arena = arena;
     return tree;
 }
 
@@ -347,6 +400,9 @@ struct tree *make_tree_origin(struct tree *root) {
 void free_tree_node(struct tree *tree) {
     if (tree == NULL)
         return;
+    /* Released with the arena */
+    if (tree->arena != NULL)
+        return;
 
     if (tree->span != NULL)
         free_span(tree->span);
@@ -454,4 +510,449 @@ int tree_equal(const struct tree *t1, const struct tree *t2) {
     return t1 == t2;
 }
 
+/*
+ * Tree arenas
+ */
+
+/* Blocks start out small so that the arenas of small trees stay small,
+ * and double in size up to ARENA_MAX_BLOCK */
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+struct arena_block {
+    struct arena_block *next;
+    size_t              size;     /* Number of bytes in DATA */
+    size_t              used;
+    char                data[];
+};
+
+struct tree_arena {
+    struct arena_block  *blocks;      /* The one we allocate from first */
+    size_t               block_size;  /* Size of the next block */
+    void               **adopted;     /* Freed when the arena is freed */
+    size_t               nadopted;
+    size_t               adopted_size;
+    /* Interned labels, as an open addressing hash table with linear
+     * probing. LABELS_SIZE is a power of 2 */
+    char               **labels;
+    size_t               nlabels;
+    size_t               labels_size;
+    /* Interned labels that are small numbers, as produced by SEQ, indexed
+     * by their value. They are too many and too different to be worth
+     * hashing */
+    char               **numbers;
+    size_t               numbers_size;
+};
+
+struct tree_arena *make_tree_arena(void) {
+    struct tree_arena *arena;
+
+    if (ALLOC(arena) < 0)
+        return NULL;
+    arena->block_size = ARENA_MIN_BLOCK;
+    return arena;
+}
+
+void free_tree_arena(struct tree_arena *arena) {
+    if (arena == NULL)
+        return;
+    for (size_t i=0; i < arena->nadopted; i++)
+        free(arena->adopted[i]);
+    free(arena->adopted);
+    free(arena->labels);
+    free(arena->numbers);
+    while (arena->blocks != NULL) {
+        struct arena_block *del = arena->blocks;
+        arena->blocks = del->next;
+        free(del);
+    }
+    free(arena);
+}
+
+static struct arena_block *arena_block(size_t size) {
+    struct arena_block *block = malloc(sizeof(*block) + size);
+
+    if (block == NULL)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/* Carve SIZE bytes aligned to ALIGN out of BLOCK if they fit */
+static void *block_take(struct arena_block *block, size_t size,
+                        size_t align) {
+    uintptr_t pos = (uintptr_t) (block->data + block->used);
+    size_t start = block->used + (-pos & (align - 1));
+
+    if (start > block->size || size > block->size - start)
+        return NULL;
+    block->used = start + size;
+    return block->data + start;
+}
+
+/* Return SIZE bytes from ARENA, aligned to ALIGN, which must be a power
+ * of 2 */
+static void *arena_take(struct tree_arena *arena, size_t size,
+                        size_t align) {
+    struct arena_block *block;
+    void *p;
+
+    if (arena->blocks != NULL) {
+        p = block_take(arena->blocks, size, align);
+        if (p != NULL)
+            return p;
+    }
+
+    if (size > arena->block_size / 4) {
+        /* Big requests get a block of their own, behind the current one,
+         * so that we do not waste what is left of that */
+        block = arena_block(size + align);
+        if (block == NULL)
+            return NULL;
+        if (arena->blocks == NULL) {
+            arena->blocks = block;
+        } else {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+    } else {
+        block = arena_block(arena->block_size);
+        if (block == NULL)
+            return NULL;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        if (arena->block_size < ARENA_MAX_BLOCK)
+            arena->block_size *= 2;
+    }
+    return block_take(block, size, align);
+}
+
+void *tree_arena_alloc(struct tree_arena *arena, size_t size) {
+    return arena_take(arena, size, ARENA_ALIGN);
+}
+
+char *tree_arena_strndup(struct tree_arena *arena, const char *s,
+                         size_t len) {
+    char *str = arena_take(arena, len + 1, 1);
+
+    if (str == NULL)
+        return NULL;
+    memcpy(str, s, len);
+    str[len] = '\0';
+    return str;
+}
+
+int tree_arena_reserve(struct tree_arena *arena, size_t n) {
+    size_t size = arena->adopted_size;
+
+    if (n <= size - arena->nadopted)
+        return 0;
+    size = (size < 16) ? 16 : 2 * size;
+    if (size - arena->nadopted < n)
+        size = arena->nadopted + n;
+    if (REALLOC_N(arena->adopted, size) < 0)
+        return -1;
+    arena->adopted_size = size;
+    return 0;
+}
+
+int tree_arena_adopt(struct tree_arena *arena, void *p) {
+    if (p == NULL)
+        return 0;
+    if (tree_arena_reserve(arena, 1) < 0)
+        return -1;
+    arena->adopted[arena->nadopted++] = p;
+    return 0;
+}
+
+static size_t label_hash(const char *s, size_t len) {
+    size_t h = 2166136261UL;
+    for (size_t i=0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/* Move the labels of ARENA into a table twice the size */
+static int labels_grow(struct tree_arena *arena) {
+    size_t size = (arena->labels_size == 0) ? 64 : 2 * arena->labels_size;
+    char **labels = NULL;
 
+    if (ALLOC_N(labels, size) < 0)
+        return -1;
+    for (size_t i=0; i < arena->labels_size; i++) {
+        char *l = arena->labels[i];
+        if (l == NULL)
+            continue;
+        size_t h = label_hash(l, strlen(l)) & (size - 1);
+        while (labels[h] != NULL)
+            h = (h + 1) & (size - 1);
+        labels[h] = l;
+    }
+    free(arena->labels);
+    arena->labels = labels;
+    arena->labels_size = size;
+    return 0;
+}
+
+/* Return the slot for S in ARENA->NUMBERS if S is the decimal form of a
+ * number that is not much larger than the ones we have seen so far, and
+ * NULL otherwise. Set *ERR on allocation failure */
+static char **number_slot(struct tree_arena *arena, const char *s,
+                          size_t len, bool *err) {
+    size_t n = 0;
+
+    if (len == 0 || len > 9 || (s[0] == '0' && len > 1))
+        return NULL;
+    for (size_t i=0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return NULL;
+        n = 10 * n + (s[i] - '0');
+    }
+    if (n >= arena->numbers_size) {
+        size_t size = (arena->numbers_size == 0) ? 64 : arena->numbers_size;
+        while (size <= n && size <= 2 * arena->numbers_size + 64)
+            size *= 2;
+        if (size <= n)
+            return NULL;
+        if (REALLOC_N(arena->numbers, size) < 0) {
+            *err = true;
+            return NULL;
+        }
+        MEMZERO(arena->numbers + arena->numbers_size,
+                size - arena->numbers_size);
+        arena->numbers_size = size;
+    }
+    return arena->numbers + n;
+}
+
+char *tree_arena_intern(struct tree_arena *arena, const char *s,
+                        size_t len) {
+    size_t h;
+    char *l, **slot;
+    bool err = false;
+
+    slot = number_slot(arena, s, len, &err);
+    if (err)
+        return NULL;
+    if (slot != NULL) {
+        if (*slot == NULL)
+            *slot = tree_arena_strndup(arena, s, len);
+        return *slot;
+    }
+
+    /* Keep the table at most half full */
+    if (2 * (arena->nlabels + 1) > arena->labels_size) {
+        if (labels_grow(arena) < 0)
+            return NULL;
+    }
+
+    h = label_hash(s, len) & (arena->labels_size - 1);
+    while ((l = arena->labels[h]) != NULL) {
+        if (strncmp(l, s, len) == 0 && l[len] == '\0')
+            return l;
+        h = (h + 1) & (arena->labels_size - 1);
+    }
+
+    l = tree_arena_strndup(arena, s, len);
+    if (l == NULL)
+        return NULL;
+    arena->labels[h] = l;
+    arena->nlabels += 1;
+    return l;
+}
+
+/*
+ * Flat trees
+ */
+
+/* Where each distinct label is in the strings of a flat tree. Labels are
+ * told apart by address only, which finds all duplicates in arena trees,
+ * where labels are interned */
+struct flat_labels {
+    const char **labels;
+    int         *offsets;
+    size_t       nlabels;
+    size_t       size;
+};
+
+/* The arrays of a flat tree while we fill them; they grow as needed */
+struct flatten {
+    struct flat_labels     labels;
+    struct hera_flat_node *nodes;
+    size_t                 nnodes;
+    size_t                 nodes_size;
+    char                  *strings;
+    size_t                 strings_len;
+    size_t                 strings_size;
+};
+
+static size_t flat_label_slot(struct flat_labels *fl, const char *label) {
+    size_t h = ((uintptr_t) label >> 3) * 2654435761UL;
+
+    h &= fl->size - 1;
+    while (fl->labels[h] != NULL && fl->labels[h] != label)
+        h = (h + 1) & (fl->size - 1);
+    return h;
+}
+
+static int flat_labels_grow(struct flat_labels *fl) {
+    struct flat_labels bigger = *fl;
+
+    bigger.size = (fl->size == 0) ? 64 : 2 * fl->size;
+    if (ALLOC_N(bigger.labels, bigger.size) < 0)
+        return -1;
+    if (ALLOC_N(bigger.offsets, bigger.size) < 0) {
+        free(bigger.labels);
+        return -1;
+    }
+    for (size_t i=0; i < fl->size; i++) {
+        if (fl->labels[i] == NULL)
+            continue;
+        size_t h = flat_label_slot(&bigger, fl->labels[i]);
+        bigger.labels[h] = fl->labels[i];
+        bigger.offsets[h] = fl->offsets[i];
+    }
+    free(fl->labels);
+    free(fl->offsets);
+    *fl = bigger;
+    return 0;
+}
+
+/* Append S to the strings of FL and return its offset there, or -1 */
+static int flat_string(struct flatten *fl, const char *s, int *len) {
+    size_t n = strlen(s);
+    int offset = fl->strings_len;
+
+    if (n >= INT_MAX - fl->strings_len)
+        return -1;
+    if (fl->strings_len + n + 1 > fl->strings_size) {
+        size_t size = 2 * fl->strings_size + n + 1;
+        if (REALLOC_N(fl->strings, size) < 0)
+            return -1;
+        fl->strings_size = size;
+    }
+    memcpy(fl->strings + fl->strings_len, s, n + 1);
+    fl->strings_len += n + 1;
+    *len = n;
+    return offset;
+}
+
+static int flat_label(struct flatten *fl, const char *label, int *len) {
+    size_t h;
+
+    if (2 * (fl->labels.nlabels + 1) > fl->labels.size) {
+        if (flat_labels_grow(&fl->labels) < 0)
+            return -1;
+    }
+    h = flat_label_slot(&fl->labels, label);
+    if (fl->labels.labels[h] == NULL) {
+        int offset = flat_string(fl, label, len);
+        if (offset < 0)
+            return -1;
+        fl->labels.labels[h] = label;
+        fl->labels.offsets[h] = offset;
+        fl->labels.nlabels += 1;
+        return offset;
+    }
+    *len = strlen(label);
+    return fl->labels.offsets[h];
+}
+
+/* Add nodes for TREE and its siblings, whose parent is PARENT, and set
+ * *FIRST to the index of the first one. Return -1 on error */
+static int flatten(struct flatten *fl, struct tree *tree, int parent,
+                   int *first) {
+    int prev = -1;
+
+    *first = -1;
+    list_for_each(t, tree) {
+        struct hera_flat_node *node;
+        int i = fl->nnodes;
+
+        if (fl->nnodes == fl->nodes_size) {
+            size_t size = (fl->nodes_size == 0) ? 64 : 2 * fl->nodes_size;
+            if (size > INT_MAX)
+                size = INT_MAX;
+            if (size == fl->nodes_size)
+                return -1;
+            if (REALLOC_N(fl->nodes, size) < 0)
+                return -1;
+            fl->nodes_size = size;
+        }
+        fl->nnodes += 1;
+
+        node = fl->nodes + i;
+        node->parent = parent;
+        node->next = -1;
+        node->label = node->value = -1;
+        node->label_len = node->value_len = 0;
+        if (t->label != NULL) {
+            node->label = flat_label(fl, t->label, &node->label_len);
+            if (node->label < 0)
+                return -1;
+        }
+        if (t->value != NULL) {
+            node->value = flat_string(fl, t->value, &node->value_len);
+            if (node->value < 0)
+                return -1;
+        }
+        if (prev < 0)
+            *first = i;
+        else
+            fl->nodes[prev].next = i;
+        prev = i;
+
+        int child;
+        if (flatten(fl, t->children, i, &child) < 0)
+            return -1;
+        fl->nodes[i].first_child = child;
+    }
+    return 0;
+}
+
+struct hera_flat *tree_flatten(struct tree *tree) {
+    struct flatten fl;
+    struct hera_flat *flat = NULL;
+    int first;
+
+    MEMZERO(&fl, 1);
+    if (flatten(&fl, tree, -1, &first) < 0)
+        goto error;
+    if (ALLOC(flat) < 0)
+        goto error;
+
+    /* Never leave NODES or STRINGS NULL, so that callers can tell an empty
+     * tree from an error by looking at them alone */
+    if (fl.nodes == NULL && ALLOC(fl.nodes) < 0)
+        goto error;
+    if (fl.strings == NULL && ALLOC(fl.strings) < 0)
+        goto error;
+    flat->nnodes = fl.nnodes;
+    flat->nodes = fl.nodes;
+    flat->size = fl.strings_len;
+    flat->strings = fl.strings;
+
+    free(fl.labels.labels);
+    free(fl.labels.offsets);
+    return flat;
+ error:
+    free(fl.labels.labels);
+    free(fl.labels.offsets);
+    free(fl.nodes);
+    free(fl.strings);
+    free(flat);
+    return NULL;
+}
+
+void free_hera_flat(struct hera_flat *flat) {
+    if (flat == NULL)
+        return;
+    free(flat->nodes);
+    free(flat->strings);
+    free(flat);
+}